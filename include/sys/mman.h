@@ -0,0 +1,24 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* #defines from the kernel
+ */
+#include <kern/mman.h>
+
+/* Returned by mmap on error */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * OS/161 has no file descriptors to map, so mmap takes the PATH of the
+ * file instead; it is ignored with MAP_ANON. OFFSET must be a multiple
+ * of the page size. ADDR is only a hint, and at the moment the kernel
+ * always picks the address itself.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags,
+	   const char *path, off_t offset);
+int munmap(void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */
@@ -31,13 +31,23 @@ void TLB_Write(u_int32_t entryhi, u_int32_t entrylo, u_int32_t index);
 void TLB_Read(u_int32_t *entryhi, u_int32_t *entrylo, u_int32_t index);
 int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
+/*
+ *   TLB_SetASID: make ASID the current address space ID. Only TLB
+ *        entries tagged with it will match from now on.
+ *
+ *        The functions above use ENTRYHI to pass the entry in, but
+ *        put the current ASID back before they return.
+ */
+void TLB_SetASID(u_int32_t asid);
+
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * The MIPS has support for a 6-bit address space ID (TLBHI_PID). An entry
+ * only matches while its PID is the current one, so each address space
+ * gets its own and the TLB needn't be flushed on a context switch.
+ * TLBLO_GLOBAL can be left always zero, as can the bits that aren't
+ * assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -49,7 +59,8 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -72,5 +83,11 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs.
+ */
+
+#define NUM_ASID 64
+
 
 #endif /* _MACHINE_TLB_H_ */
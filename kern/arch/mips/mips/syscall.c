@@ -107,6 +107,18 @@ mips_syscall(struct trapframe *tf)
 		case SYS___time:
 			err = sys_time((time_t *)&retval,(time_t *)tf->tf_a0,(unsigned long *)tf->tf_a1);
 			break;
+
+		case SYS_sbrk:
+			retval = (int)sys_sbrk(tf->tf_a0, &err);
+			break;
+
+		case SYS_mmap:
+			retval = sys_mmap((void *)tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3, (userptr_t)tf->tf_sp, &err);
+			break;
+
+		case SYS_munmap:
+			err = sys_munmap((void *)tf->tf_a0, tf->tf_a1);
+			break;
  
 		
 		
@@ -8,6 +8,7 @@
 #include <thread.h>
 #include <curthread.h>
 #include <array.h>
+#include <syscall.h>
 
 extern u_int32_t curkstack;
 
@@ -212,6 +213,15 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * The OOM killer took this process's memory; it must not run
+	 * user code again (see oom_kill in vm.c).
+	 */
+	if (!iskern && curthread != NULL && curthread->t_oomkilled) {
+		splx(savespl);
+		sys__exit(OOM_EXITCODE);
+	}
+
 	/* Make sure interrupts are off */
 	splhigh();
 
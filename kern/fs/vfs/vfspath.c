@@ -9,6 +9,7 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <lib.h>
+#include <vm.h>
 
 
 /* Does most of the work for open(). */
@@ -65,6 +66,11 @@ vfs_open(char *path, int openflags, struct vnode **ret)
 	}
 
 	VOP_INCOPEN(vn);
+
+	/* Cached pages of an executable go stale once it is written to */
+	if (canwrite) {
+		pagecache_invalidate(vn);
+	}
 	
 	if (openflags & O_TRUNC) {
 		if (canwrite==0) {
@@ -23,6 +23,7 @@ struct vnode;
 #define IS_DIRTY(x)   ( 0x00002000 & x )  // Check if PTE is dirty
 #define IS_REF(x)     ( 0x00004000 & x )  // Check if PTE is referenced
 #define GET_PFN(x)    ( 0x000003FF & x )  // Get PFN of the PTE
+#define PFN_MASK      0x000003FF          // PFN field of the PTE
 #define IS_RDABLE(x)  ( 0x00000400 & x )  // Check if PTE is readable
 #define IS_WTABLE(x)  ( 0x00000800 & x )  // Check if PTE is writable
 #define IS_XTABLE(x)  ( 0x00001000 & x )  // Check if PTE is executable
@@ -31,19 +32,34 @@ struct vnode;
 #define SET_WTABLE(x)  ( 0x00000800 | x )  // Check if PTE is writable
 #define SET_XTABLE(x)  ( 0x00001000 | x )  // Check if PTE is executable
 
+#define SET_VALID(x)   ( 0x00008000 | (x) )  // Set PTE valid
+#define SET_REF(x)     ( 0x00004000 | (x) )  // Set PTE referenced
+#define CLR_REF(x)     ( ~0x00004000 & (x) ) // Clear PTE referenced
+#define SET_DIRTY(x)   ( 0x00002000 | (x) )  // Set PTE dirty
+#define SET_PFN(x,y)   ( (~PFN_MASK & (x)) | (y) )  // Replace PFN of x with y
 
-/* Macros for ELF PTE */
-#define IS_ELF(x)     ( 0x80000000 & x )  // Check if PTE is load_elf format
-#define SET_ELF(x)    ( 0x80000000 | x )  // Set ELF bit to 1
-#define IS_E_XBLE(x)  ( 0x40000000 & x )  // Check if PTE is load_elf is_executable
-#define SET_E_XBLE(x) ( 0x40000000 | x )  // Set is_executable bit
+/* Valid PTE mapping the shared zero page (see vm.c), read-only until written */
+#define IS_ZEROPAGE(x) ( IS_VALID(x) && GET_PFN(x) == zeropage / PAGE_SIZE )
 
-#define GET_FOFFS(x)  ( 0x000003FF &x )   // Get the file offset for load_segment
-#define SET_FOFFS(x,y) ( x | y)           // Set file offset, x is PTE and y is fileoffset
-#define GET_FSIZE(x)  ( (0x000FFC00 &x)>>10 )  // Get the Filesize for load_segment
-#define SET_FSIZE(x,y) ( x | (y<<10) )    // Set filesize, x is PTE and y is filesize
-#define GET_MEMSZ(x)  ( (0x3FF00000 &x)>>20 )  // Get the memsize for load_segment
-#define SET_MEMSZ(x)  ( x | (y<<20))      // Set memsize, x is PTE and y is memsz
+/* Copy-on-write: page is shared with another as, writes must split it */
+#define IS_COW(x)      ( 0x00010000 & (x) )
+#define SET_COW(x)     ( 0x00010000 | (x) )
+#define CLR_COW(x)     ( ~0x00010000 & (x) )
+
+/* Macros for swapped-out PTE (valid bit off, page lives in a swap slot) */
+#define IS_SWAPPED(x)    ( 0x00020000 & (x) )
+#define GET_SWAPSLOT(x)  ( (0x7FFC0000 & (x)) >> 18 )
+#define GET_PROT(x)      ( 0x00011C00 & (x) )  // COW & X/W/R bits, kept across swapping
+#define SET_SWAPPED(x,y) ( GET_PROT(x) | 0x00020000 | ((y) << 18) )
+
+
+/*
+ * Macros for ELF PTE (page of the executable that hasn't been read in
+ * yet). Only the protection is kept in the PTE; where the contents come
+ * from is looked up in the address space's segment list on the fault.
+ */
+#define IS_ELF(x)     ( 0x80000000 & (x) )  // Check if PTE is load_elf format
+#define SET_ELF(x)    ( 0x80000000 | (x) )  // Set ELF bit to 1
 
 /* Macros for vaddr */
 #define GET_OFFS(x)   ( 0x00000FFF & x )  // Get the vaddr offset
@@ -54,17 +70,62 @@ struct page_table {
 	int PTE[1024];
 };
 
-/*   Structure of the PTE:  Total 16 bits
+#define PT_SPAN (PTE_MAX * PAGE_SIZE)  // bytes of address space one page table maps
+
+/*   Structure of the PTE:  Total 17 bits
  *
- *  |  1 bit  |  1 bit  |  1 bit  | 3 bits |    10 bits    |
- *     valid      ref      dirty    X/W/R         PFN
+ *  |  1 bit  |  1 bit  |  1 bit  |  1 bit  | 3 bits |    10 bits    |
+ *      cow      valid      ref      dirty    X/W/R         PFN
+ *
+ *
+ *   Structure of the swapped-out PTE:
+ *
+ *  | 1 bit |  13 bits  |  1 bit  | 1 bit | 3 bits | 10 bits |
+ *     0      swap slot   swapped    cow    X/W/R       0
  *
  *
  *   Structure of the ELF PTE:
  *
- *  |   1 bit  |    1 bit   |   10 bits  |  10 bits  |  10 bits  |
- *   Elf bit     is_xtable    memsize      filesize    file offset
+ *  | 1 bit |  16 bits  | 3 bits | 10 bits |
+ *    ELF        0        X/W/R       0
+ */
+
+/*
+ * A loadable segment of the executable. Its pages are read from the
+ * file on first touch; the part of memsize past filesize is zeros.
  */
+struct elf_segment {
+	vaddr_t es_vaddr;      // start of the segment in memory
+	size_t es_memsize;     // size in memory
+	size_t es_filesize;    // bytes that come from the file
+	off_t es_offset;       // where those bytes are in the file
+};
+
+#define ELF_MAXSEGS 4
+
+/*
+ * A region (VMA) of the address space: a page aligned range whose pages
+ * share a protection and a backing. The regions of an address space are
+ * kept on a list sorted by address and never overlap. An address that
+ * is not in any region is not mapped at all.
+ */
+#define VR_ELF    0   // read from the executable on first touch (as_segs)
+#define VR_HEAP   1   // zero-filled on first touch, grown by sbrk
+#define VR_STACK  2   // zero-filled on first touch
+#define VR_ANON   3   // anonymous mmap, zero-filled on first touch
+#define VR_FILE   4   // mmap of vr_vnode, read from it on first touch
+
+struct vm_region {
+	vaddr_t vr_start;            // first page of the region
+	size_t vr_npages;            // # of pages, may be 0 (empty heap)
+	int vr_prot;                 // X/W/R bits, in PTE format
+	int vr_type;                 // backing, VR_*
+	struct vnode *vr_vnode;      // VR_FILE: the mapped file, open for us
+	off_t vr_offset;             // VR_FILE: file offset of vr_start
+	struct vm_region *vr_next;   // next region up, NULL if last
+};
+
+#define VR_END(vr) ( (vr)->vr_start + (vr)->vr_npages * PAGE_SIZE )
 
 
 struct addrspace {
@@ -82,22 +143,27 @@ struct addrspace {
 	// different page table, saves a lot of memory as it does not need to allocate 1024
 	// page tables at once
 	struct page_table *page_directory[1024];
+
+	/* Executable that ELF PTEs are loaded from, and its segments */
 	struct vnode *v;
+	struct elf_segment as_segs[ELF_MAXSEGS];
+	int as_nsegs;
 
-	/* Data & code segments*/
-	vaddr_t as_vbase1;
-	size_t as_npages1;
-	u_int32_t as_permission1;
+	// TLB tag, generation in the upper bits, 0 if none (see vm.c)
+	u_int32_t as_asid;
 
-	vaddr_t as_vbase2;
-	size_t as_npages2;
-	u_int32_t as_permission2;
+	/* Mapped regions, sorted by address */
+	struct vm_region *as_regions;
 
-	/* Heap & stack region */
-	vaddr_t heapvbase;
-	vaddr_t heapvtop;
+	/* The heap region, NULL until as_complete_load */
+	struct vm_region *as_heap;
 
-	vaddr_t stackvbase;
+	// Current break, moved by sbrk. The heap region covers it
+	// rounded up to a whole page.
+	vaddr_t as_heapbrk;
+
+	// Frames mapped by our PTEs, shared ones included (see vm.c)
+	int as_rss;
 
 #endif
 };
@@ -151,7 +217,38 @@ int		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 vaddr_t vaddr_join(u_int32_t pdir_index, u_int32_t ptable_index);
-int as_get_permission(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * as_region - return the region of AS that VADDR is in, NULL if VADDR
+ *             isn't mapped.
+ *
+ * as_add_region - add a region of NPAGES pages at page aligned START,
+ *             with protection PROT (PTE format) and backing TYPE.
+ *             Returns NULL if it would overlap another region, or on
+ *             ENOMEM.
+ *
+ * as_remove_region - take VR out of AS and free it, closing its file.
+ *             Its pages must have been unmapped already.
+ *
+ * as_unmap - drop the pages in [START, END) of AS: frames and swap
+ *             slots are freed and the PTEs cleared. May sleep.
+ *
+ * as_droptables - free the page tables that map any of [START, END)
+ *             and have no PTEs left.
+ */
+struct vm_region *as_region(struct addrspace *as, vaddr_t vaddr);
+struct vm_region *as_add_region(struct addrspace *as, vaddr_t start,
+				size_t npages, int prot, int type);
+void as_remove_region(struct addrspace *as, struct vm_region *vr);
+void as_unmap(struct addrspace *as, vaddr_t start, vaddr_t end);
+void as_droptables(struct addrspace *as, vaddr_t start, vaddr_t end);
+
+/*
+ * find_pte - return a pointer to the PTE for VADDR in AS. If the page
+ *            table for it doesn't exist yet it is created when CREATE
+ *            is set, otherwise NULL is returned. Also NULL on ENOMEM.
+ */
+int *find_pte(struct addrspace *as, vaddr_t vaddr, int create);
 
 /*
  * Functions in loadelf.c
@@ -162,6 +259,24 @@ int as_get_permission(struct addrspace *as, vaddr_t vaddr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
+/*
+ *    load_elf_page - fill the physical page PADDR with the contents of
+ *               the executable page at VADDR in AS: the file data of
+ *               every segment that overlaps it, zeros everywhere else.
+ *               May sleep.
+ */
+
+int load_elf_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+
+/*
+ * Functions in syscall/sys_mmap.c
+ *    mmap_load_page - fill the physical page PADDR with the page of the
+ *               VR_FILE region VR at VADDR, zeros past the end of the
+ *               file. May sleep.
+ */
+
+int mmap_load_page(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr);
+
 
 
 #endif /* _ADDRSPACE_H_ */
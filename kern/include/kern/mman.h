@@ -0,0 +1,20 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap
+ */
+
+/* Protection for the mapped pages: or together any of these */
+#define PROT_NONE     0      /* Pages may not be accessed */
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    1      /* Share the mapping (read-only mappings only) */
+#define MAP_PRIVATE   2      /* Writes stay private to the process */
+/* then or in this if wanted: */
+#define MAP_ANON      4      /* Not backed by a file, starts out zeroed */
+
+#endif /* _KERN_MMAN_H_ */
@@ -91,6 +91,16 @@ void *kmalloc(size_t sz);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Bytes of memory kmalloc(sz) really uses.
+ */
+size_t kmalloc_size(size_t sz);
+
+/*
+ * Like kmalloc, but the memory comes back zeroed.
+ */
+void *kzalloc(size_t sz);
+
 /*
  * C string functions. 
  *
@@ -9,6 +9,14 @@
  *                     already on the run queue or sleeping, weird things
  *                     may happen. Returns an error code.
  *
+ *     scheduler_tick - called by hardclock on every tick; returns nonzero
+ *                     if the current thread should be preempted.
+ *
+ *     scheduler_priority - priority of a thread for priority inheritance;
+ *                     lower numbers run first.
+ *     scheduler_inherit - make a thread run at (at least) the given
+ *                     priority, or drop the inherited one if it is -1.
+ *
  *     print_run_queue - dump the run queue to the console for debugging.
  *
  *     scheduler_bootstrap - initialize scheduler data 
@@ -22,6 +30,9 @@ struct thread;
 
 struct thread *scheduler(void);
 int make_runnable(struct thread *t);
+int scheduler_tick(void);
+int scheduler_priority(struct thread *t);
+void scheduler_inherit(struct thread *t, int prio);
 
 void print_run_queue(void);
 
@@ -5,6 +5,42 @@
 #ifndef _SYNCH_H_
 #define _SYNCH_H_
 
+/*
+ * Contention profiling.
+ *
+ * Every semaphore, lock and CV counts how often it was taken (P,
+ * lock_acquire, cv_wait) and how many of those had to sleep. While
+ * timing is turned on with synchprof_settiming, the time spent asleep
+ * and the time locks are held are added up too, by the real-time clock.
+ * Timing is off by default since reading the clock is slow and there is
+ * no clock early in boot. Totals are kept as seconds plus microseconds
+ * so they don't wrap on a busy lock; the maximums are in microseconds
+ * and stick at 0xffffffff.
+ *
+ * synchprof_print lists the N most contended primitives by name.
+ */
+
+struct synchprof {
+	const char *sp_kind;		// "sem", "lock" or "cv"
+	const char *sp_name;		// the primitive's name
+	u_int32_t sp_acquires;
+	u_int32_t sp_contended;		// ... that had to sleep
+	u_int32_t sp_waitsecs;		// total time asleep
+	u_int32_t sp_waitus;		// ... and microseconds
+	u_int32_t sp_maxwaitus;
+	u_int32_t sp_holdsecs;		// total time held, locks only
+	u_int32_t sp_holdus;		// ... and microseconds
+	u_int32_t sp_maxholdus;
+	int sp_holding;			// hold time started at sp_startsecs
+	time_t sp_startsecs;
+	u_int32_t sp_startnsecs;
+	struct synchprof *sp_prev;	// list of all primitives
+	struct synchprof *sp_next;
+};
+
+void synchprof_settiming(int on);
+void synchprof_print(int n);
+
 /*
  * Dijkstra-style semaphore.
  * Operations:
@@ -21,6 +57,7 @@
 struct semaphore {
 	char *name;
 	volatile int count;
+	struct synchprof sem_prof;
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -45,6 +82,14 @@ void              sem_destroy(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * Waiting threads queue up on the lock in FIFO order, and lock_release
+ * hands the lock straight to the first of them, so a thread that comes
+ * along later can't take it first.
+ *
+ * A thread waiting for a lock lends its scheduler priority to the
+ * holder, and on through the lock the holder is waiting for, if any.
+ * The holder gives it back in lock_release.
+ *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
  */
@@ -57,6 +102,10 @@ struct lock {
 	volatile int held;		// 0 means lock free; 1 means lock held
 	int old_priority;		// used to restore interrupt enable to state it was in before we change it
 	struct thread *holding_thread;	// thread holding lock
+	struct lock *lk_nextheld;	// next lock held by holding_thread
+	struct thread *lk_waithead;	// threads waiting, through t_waitnext
+	struct thread *lk_waittail;
+	struct synchprof lk_prof;
 	//struct queue lockq;
 
 };
@@ -98,6 +147,7 @@ struct cv {
 	char *name;
 	// add what you need here
 	// (don't forget to mark things volatile as needed)
+	struct synchprof cv_prof;
 };
 
 struct cv *cv_create(const char *name);
@@ -28,5 +28,11 @@ int sys_waitpid(int pid, int *status, int options, int *errno);
 
 int sys_time(time_t *secondsKrn, time_t* seconds, unsigned long *nanoseconds);
 
+void *sys_sbrk(intptr_t amount, int *errno);
+
+int sys_mmap(void *addr, size_t len, int prot, int flags, userptr_t sp, int *errno);
+
+int sys_munmap(void *addr, size_t len);
+
 
 #endif /* _SYSCALL_H_ */
@@ -48,8 +48,21 @@ struct thread {
 	struct pcb t_pcb;
 	char *t_name;
 	const void *t_sleepaddr;
+	struct thread *t_sleepnext;   // next sleeper in the same wait bucket
 	char *t_stack;
 	//struct array *fd_table;
+
+	/* Scheduler state, only used by the MLFQ scheduler */
+	int t_level;          // priority level, 0 is the highest
+	int t_ticks;          // ticks used of the current quantum
+	u_int32_t t_boost;    // boost the level was set in
+	int t_queued;         // run queue it is on, -1 if none
+	int t_inherit;        // priority inherited through a lock, -1 if none
+
+	/* Priority inheritance, see synch.c */
+	struct lock *t_waitlock;   // lock it is waiting for
+	struct thread *t_waitnext; // next thread waiting for the same lock
+	struct lock *t_heldlocks;  // locks it holds, through lk_nextheld
 		
 	/**********************************************************/
 	/* Public thread members - can be used by other code      */
@@ -80,6 +93,9 @@ struct thread {
 	int exit_status;
 	int exit_code;
 
+	/* Set by the OOM killer, exit on the way back to user mode */
+	int t_oomkilled;
+
 	/* Thread's cv for waitpid & exit */
 	struct semaphore *waitpid_sem;
 	struct semaphore *exit_sem;
@@ -158,6 +174,11 @@ thread_wakeone(const void *addr);
  */
 int thread_hassleepers(const void *addr);
 
+/*
+ * Number of context switches to a different thread since boot.
+ */
+extern u_int32_t thread_switches;
+
 
 /*
  * Private thread functions.
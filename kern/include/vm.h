@@ -25,27 +25,89 @@ typedef enum{
 	/* For coremap */
 	PFREE,    // page is free, can be allocated	
 	PKERNEL,  // page is allocated for kernel, don't mess with it
+	PZERO,    // page is free and already zeroed, on the zero pool
 
 	/* User page */	 
 	PDIRTY,   // page is dirty, need to be flushed when replaced
-	PCLEAN    // page is clean, can be free without flushing
+	PCLEAN,   // page is clean, can be free without flushing
+
+	/* Page cache */
+	PCACHED   // executable page nobody maps, kept for reuse (pagecache.c)
 }p_state;
 
 
+struct addrspace;
+
+
+/*
+ *  SWAP RELATED STUFF (vm/swap.c)
+ */
+
+/* Raw disk used as swap space, must not hold a filesystem */
+#define SWAP_DEVICE "lhd1raw:"
+
+/* Bounded by the slot field of a swapped-out PTE (see addrspace.h) */
+#define SWAP_MAXSLOTS 8192
+
+/* Serializes swap I/O; held across savepages/loadpage */
+struct lock *swap_lock;
+
+// Open the swap device and set up the slot bitmap
+void swap_bootstrap(void);
+
+// Nonzero if a swap device is available
+int swap_enabled(void);
+
+// Allocate a free swap slot / share it on fork / drop a reference
+int swap_alloc(int *slot);
+void swap_share(int slot);
+int swap_refcount(int slot);
+void swap_free(int slot);
+
+// Swaps out npages pages from a kernel buffer to consecutive swap slots,
+// starting at the given one. Pages that don't fit in the compressed
+// cache go to disk, in as few transfers as possible.
+// Sleeps; the caller must hold swap_lock.
+int savepages(const void *buf, int slot, int npages);
+
+// Same, but straight to disk in one transfer, bypassing the cache
+int swap_write(const void *buf, int slot, int npages);
+
+// Reads the given swap slot into the physical page at paddr.
+// Sleeps; the caller must hold swap_lock.
+int loadpage(int slot, paddr_t paddr);
+
+// Print swap usage and swap-in/swap-out counts
+void swap_printstats(void);
+
+/*
+ * Compressed swap cache (vm/zswap.c), keyed by swap slot. Pages put in
+ * it don't have to be written to the swap disk.
+ */
+
+// Set up the pool for a swap disk of nslots slots
+void zswap_bootstrap(int nslots);
 
-// Writes the the specified page of the process to the swap file.
-// Info about the actual physical address of the page and the
-// offset to place it in the file is taken from curthread
-void savepage(int vpage);
+// Compress page into the pool under slot; nonzero if it has to go to
+// disk instead. May write older pages out to make room, so the caller
+// must hold swap_lock.
+int zswap_store(int slot, const void *page);
 
-// Reads the the specified page of the process from the swap file
-// and loads it into the physical page specified.
-// Info about the actual physical address of the vpage and the
-// offset in the file where it is found is taken from curthread
-void loadpage(int vpage, int ppage);
+// Decompress slot into page; ENOENT if the pool doesn't have it.
+// The caller must hold swap_lock.
+int zswap_load(int slot, void *page);
 
-// holds index of tlb entry to replace 
-int nextEvict;
+// Drop the compressed copy of slot, if any
+void zswap_invalidate(int slot);
+
+// Count a swap-in taking usecs, from the pool if hit is set
+void zswap_account(int hit, u_int32_t usecs);
+
+// Turn compression of outgoing pages on or off, resetting the counters
+void zswap_setenabled(int on);
+
+// Print pool usage, compression ratio, hit rate and swap-in times
+void zswap_printstats(void);
 
 // for debugging
 // print hexdump of tlb
@@ -64,8 +126,27 @@ struct coremap_entry {
 	paddr_t paddr;  // paddr of this page
 	unsigned block_size; // size of chunk, need for free_kpages (not used by user alloc)
 	p_state pstate;   // page status, look at the enum on top
+	int refcount;     // # of PTEs mapping this page, >1 means copy-on-write shared
+	struct addrspace *as;  // as whose PTE maps vaddr, NULL if unknown
+	int swapslot;     // swap slot holding a copy of the page, -1 if none
+	u_int32_t loadtime;  // when the page was brought in, for FIFO replacement
+	struct vnode *pc_vnode;  // executable this page caches, NULL if not cached
+	int pc_next;      // next page in the same page cache bucket, -1 if none
+
+	/* Buddy allocator bookkeeping */
+	int order;        // log2 size of the block this entry heads, -1 if not a head
+	int next_free;    // next free block of the same order, -1 if none
+	int prev_free;    // previous free block of the same order, -1 if none
 };
 
+/*
+ * Physical pages are handed out by a buddy allocator that sits on top
+ * of the coremap. Every free block is 2^order pages, is aligned to its
+ * own size (counted in coremap indices), and is linked on the free list
+ * for its order through its first coremap entry.
+ */
+#define BUDDY_MAX_ORDER 10   // largest block is 1024 pages (4 MB)
+
 //TODO: should be initialized before vmbootstrap to avoid mem leak?
 // Figure out how much entry should be in this after rambootstrap
 // # of entry is figured out in runtime
@@ -77,9 +158,14 @@ struct coremap_entry *coremap;
 struct lock* coremap_lock;
 
 /* Global for coremap */
+paddr_t zeropage;    // the shared, always zero, page (kernel-owned)
 paddr_t corebase;    // start of the free physical memory we can use
 int coremap_size;    // # of coremap_entry in coremap
 
+/* Convert between a physical address and its index in the coremap */
+#define PADDR_TO_CMINDEX(paddr) ( ((paddr) - corebase) / PAGE_SIZE )
+#define CMINDEX_TO_PADDR(index) ( corebase + (index) * PAGE_SIZE )
+
 
 
 // Not used anymore after coremap bootstrap
@@ -88,12 +174,26 @@ int coremap_size;    // # of coremap_entry in coremap
 /* Find the coremap entry given paddr */
 struct coremap_entry* get_coremapentry(paddr_t paddr);
 
-// Allocate a single free page for user, assign pid to the page
-// TODO: Doesnt support multi-processes now pid ignroed 
-paddr_t get_ppage(vaddr_t vaddr);
+// Allocate a single free page for user, owned by as at vaddr.
+// When memory is full the kernel caches are shrunk or a user page is
+// swapped out first, so this may sleep.
+paddr_t get_ppage(struct addrspace *as, vaddr_t vaddr);
+
+/* Free the page for user, only really freed once no PTE maps it anymore */
+void free_ppage(struct addrspace *as, vaddr_t va, u_int32_t pageframenumber);
+
+/* Add one more PTE mapping to a user page, in as (copy-on-write sharing) */
+void share_ppage(struct addrspace *as, u_int32_t pageframenumber);
 
-/* Free the page for user */
-void free_ppage(vaddr_t va, u_int32_t pageframenumber);
+/* What waitpid reports for a process the OOM killer took out */
+#define OOM_EXITCODE (-1)
+
+/* Number of free coremap pages, pre-zeroed ones included */
+int coremap_freepages(void);
+
+// Zero one free page for the zero pool. Called from the idle loop with
+// interrupts off; returns nonzero if it did any work.
+int vm_prezero(void);
 
 // initialize coremap
 void coremap_bootstrap(void);
@@ -101,6 +201,140 @@ void coremap_bootstrap(void);
 /* Initialization function */
 void vm_bootstrap(void);
 
+/*
+ * Shrinkers (vm/shrink.c). A kernel cache that can give memory back
+ * registers one; when the page allocator finds no free frame it calls
+ * them, in the order they were registered, before it swaps user pages
+ * out or fails.
+ *
+ * sh_shrink should free up to npages pages and return how many it
+ * freed, 0 if it had nothing. It is called with interrupts off and may
+ * only sleep when not in an interrupt handler.
+ */
+struct shrinker {
+	const char *sh_name;
+	int (*sh_shrink)(int npages);
+	u_int32_t sh_calls;    // times it was asked for memory
+	u_int32_t sh_freed;    // pages it gave back
+	struct shrinker *sh_next;
+};
+
+// Set up sh and add it to the registry, where it stays for good
+void shrinker_register(struct shrinker *sh, const char *name,
+		       int (*shrink)(int npages));
+
+// Ask the shrinkers for npages pages; returns how many were freed
+int shrink_caches(int npages);
+
+// Print what each shrinker gave back
+void shrink_printstats(void);
+
+/*
+ * Same-page merging (vm/ksm.c). A background thread maps identical user
+ * pages at the same vaddr onto one copy-on-write frame. Off by default.
+ */
+
+// Allocate the scanner's table and start its thread
+void ksm_bootstrap(void);
+
+// Turn the scanner on or off
+void ksm_setenabled(int on);
+
+// Print pages scanned and merged
+void ksm_printstats(void);
+
+/*
+ * Page cache for read-only executable pages (vm/pagecache.c), keyed by
+ * (vnode, vaddr). All of these must be called with interrupts off,
+ * except pagecache_invalidate.
+ *
+ * The key says nothing about the file's contents, so pages would go
+ * stale if the executable were rewritten. vfs_open calls
+ * pagecache_invalidate on every vnode opened for writing to prevent
+ * that.
+ */
+struct vnode;
+
+void pagecache_bootstrap(void);
+
+// paddr of the cached page, with a reference taken for as; 0 if none
+paddr_t pagecache_lookup(struct vnode *v, vaddr_t vaddr, struct addrspace *as);
+
+// Add the freshly loaded page at paddr to the cache. If another copy got
+// there first a reference to that one is returned instead, and the
+// caller frees its own page.
+paddr_t pagecache_insert(struct vnode *v, vaddr_t vaddr, paddr_t paddr);
+
+// The last PTE mapping the cached page at index went away
+void pagecache_release(int index);
+
+// Take the page at index out of the cache, if it is in it. May sleep.
+void pagecache_remove(int index);
+
+// Take an unmapped page out of the cache and return its coremap index
+// (the caller owns it now), or -1 if there is none. May sleep.
+int pagecache_reclaim(void);
+
+// Same, but only pages of v
+int pagecache_reclaimvnode(struct vnode *v);
+
+// Take the mapped pages of v out of the cache. They stay with the
+// processes that map them as ordinary pages. May sleep.
+void pagecache_detach(struct vnode *v);
+
+// Drop every page of v from the cache, freeing the unmapped ones (vm.c)
+void pagecache_invalidate(struct vnode *v);
+
+void pagecache_printstats(void);
+
+/*
+ * Page replacement (vm/replace.c). pageout asks the current policy
+ * for a victim; "fifo", "clock" and "eclock" (enhanced clock, prefers
+ * clean pages) can be switched at runtime to compare them.
+ */
+
+// Coremap index of the page to evict next, -1 if there is none.
+// Interrupts must be off.
+int replace_victim(void);
+
+// Note that the user page at index was just brought in
+void replace_loaded(int index);
+
+// Switch replacement policy by name; EINVAL if there is no such policy
+int replace_setpolicy(const char *name);
+
+// Print the policy name and its victim/second-chance counts
+void replace_printstats(void);
+
+// PTE mapping the user page at index if it may be evicted, else NULL
+int *coremap_evictable(int index);
+
+// Drop the TLB entry for vaddr in as, if it is loaded
+void tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+// Switch TLB replacement policy by name ("rr", "random", "lru");
+// EINVAL if there is no such policy
+int tlb_setpolicy(const char *name);
+
+// Set the fault-around window of a kind of region ("elf", "heap",
+// "stack", "anon" or "file") to pages on each side of a fault; 0 turns
+// it off. EINVAL if out of range.
+int vm_setfaultaround(const char *region, int pages);
+
+// Drop every TLB entry of as
+void tlb_flushas(struct addrspace *as);
+
+// Switch the TLB over to as, allocating it an ASID if it needs one
+void asid_activate(struct addrspace *as);
+
+// Page directory of the active address space, NULL if none. The UTLB
+// refill handler in exception.S walks it without going through vm_fault.
+struct page_table;
+extern struct page_table **curpgdir;
+
+/* Print coremap and paging statistics */
+void vm_printstats(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -108,4 +342,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Like alloc_kpages(1), but the page comes back zeroed (for kzalloc) */
+vaddr_t alloc_kzpage(void);
+
 #endif /* _VM_H_ */
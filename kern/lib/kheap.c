@@ -562,6 +562,46 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+/*
+ * Bytes kmalloc really takes for a request of sz bytes: the subpage
+ * size it gets rounded up to, or whole pages.
+ */
+size_t
+kmalloc_size(size_t sz)
+{
+	if (sz>=LARGEST_SUBPAGE_SIZE) {
+		return (sz + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	}
+	return sizes[blocktype(sz)];
+}
+
+/*
+ * A whole page comes from the pool of pages the idle loop has already
+ * zeroed; anything else is just cleared here.
+ */
+void *
+kzalloc(size_t sz)
+{
+	void *ptr;
+
+	if (sz>=LARGEST_SUBPAGE_SIZE && sz<=PAGE_SIZE) {
+		vaddr_t address;
+
+		address = alloc_kzpage();
+		if (address==0) {
+			return NULL;
+		}
+
+		return (void *)address;
+	}
+
+	ptr = kmalloc(sz);
+	if (ptr != NULL) {
+		bzero(ptr, sz);
+	}
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
@@ -9,6 +9,7 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <synch.h>
 #include <syscall.h>
 #include <uio.h>
 #include <vfs.h>
@@ -374,6 +375,147 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_vmstats.\n");
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command to pick the page replacement policy, so that the policies can
+ * be compared on the same workload.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_vmpolicy.\n");
+
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy fifo|clock|eclock\n");
+		return EINVAL;
+	}
+
+	return replace_setpolicy(args[1]);
+}
+
+/*
+ * Command to pick the TLB replacement policy. Resets the miss counts
+ * shown by "vm".
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_tlbpolicy.\n");
+
+	if (nargs != 2) {
+		kprintf("Usage: tlbpolicy rr|random|lru\n");
+		return EINVAL;
+	}
+
+	return tlb_setpolicy(args[1]);
+}
+
+/*
+ * Command to set the fault-around window of a region, to measure what
+ * it does for a given benchmark.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_faultaround.\n");
+
+	if (nargs != 3) {
+		kprintf("Usage: faultaround elf|heap|stack|anon|file pages\n");
+		return EINVAL;
+	}
+
+	return vm_setfaultaround(args[1], atoi(args[2]));
+}
+
+/*
+ * Command to turn the compressed swap cache on or off, to time swap-ins
+ * from it against swap-ins from disk. Resets its counters.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_zswap.\n");
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		zswap_setenabled(1);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		zswap_setenabled(0);
+		return 0;
+	}
+	kprintf("Usage: zswap on|off\n");
+	return EINVAL;
+}
+
+/*
+ * Command to turn same-page merging on or off.
+ */
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_ksm.\n");
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		ksm_setenabled(1);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		ksm_setenabled(0);
+		return 0;
+	}
+	kprintf("Usage: ksm on|off\n");
+	return EINVAL;
+}
+
+/*
+ * Command to list the most contended semaphores, locks and CVs, or to
+ * turn timing of waits and holds on (which starts the counts over) or
+ * off.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	DEBUG(DB_EXEC, "EXECUTING cmd_lockstat.\n");
+
+	if (nargs == 1) {
+		synchprof_print(10);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		synchprof_settiming(1);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		synchprof_settiming(0);
+		return 0;
+	}
+	if (nargs == 2 && atoi(args[1]) > 0) {
+		synchprof_print(atoi(args[1]));
+		return 0;
+	}
+	kprintf("Usage: lockstat [n | on | off]\n");
+	return EINVAL;
+}
+
 static
 int
 cmd_tlbdump(int nargs, char **args)
@@ -459,6 +601,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Priority inheritance test     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -576,7 +719,14 @@ static const char *mainmenu[] = {
 	"[1c] Stoplight                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[vm] VM and swap stats              ",
+	"[vmpolicy] Page replacement policy  ",
 	"[tlb] TLB dump                      ",
+	"[tlbpolicy] TLB replacement policy  ",
+	"[faultaround] Fault-around window   ",
+	"[zswap] Compressed swap on/off      ",
+	"[ksm] Same-page merging on/off      ",
+	"[lockstat] Lock contention stats    ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -633,7 +783,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",         cmd_vmstats },
+	{ "vmpolicy",	cmd_vmpolicy },
 	{ "tlb",         cmd_tlbdump },
+	{ "tlbpolicy",	cmd_tlbpolicy },
+	{ "faultaround", cmd_faultaround },
+	{ "zswap",	cmd_zswap },
+	{ "ksm",	cmd_ksm },
+	{ "lockstat",	cmd_lockstat },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -652,6 +809,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	pritest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
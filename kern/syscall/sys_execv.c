@@ -17,6 +17,8 @@ sys_execv (char *program, char **args){
 
 	int i;	//for loop indexer	
 	int result;	// use this for errors	
+	struct addrspace *old_as;	// the address space of the old program
+	struct addrspace *new_as;	// the one we failed to load into
 	int argsize;	// keep track of the total size of args we've coppied
 	int totalsize; // do.
 	char _program[PATH_MAX]; // our copy of the program string
@@ -101,33 +103,30 @@ sys_execv (char *program, char **args){
 		return result;
 	}
 	
-	// clear old addrspace
-	struct addrspace *as = curthread->t_vmspace;
-/*	
-	kfree(curthread->t_vmspace);
+	// Load the new program into a fresh address space. The old one is
+	// kept until that worked, so a bad executable still fails back.
+	old_as = curthread->t_vmspace;
 	curthread->t_vmspace = as_create();
-*/
-	as->as_vbase1 = 0;
-	//as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_permission1 = 0x0;
-	as->as_vbase2 = 0;
-	//as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_permission2 = 0x0;
-	as->heapvbase = 0;
-	as->heapvtop = 0;
-	as->stackvbase = 0;
-
-	// reset address space entrypoint and stackptr
+	if (curthread->t_vmspace == NULL) {
+		curthread->t_vmspace = old_as;
+		vfs_close(v);
+		return ENOMEM;
+	}
 	as_activate(curthread->t_vmspace);
 
 	result = load_elf(v, &entrypoint);
 	if (result) {
 		vfs_close(v);
+		new_as = curthread->t_vmspace;
+		curthread->t_vmspace = old_as;
+		as_activate(old_as);
+		as_destroy(new_as);
 		return result;
 	}
 	vfs_close(v);
+
+	// No way back from here
+	as_destroy(old_as);
 	
 	result = as_define_stack(curthread->t_vmspace, &stackptr);
 	if (result) {
@@ -98,6 +98,12 @@ sys_fork(struct trapframe *tf, int *errno){
 		goto error;
 	}
 
+	// The OOM killer may have taken our pages while we copied them
+	if (curthread->t_oomkilled){
+		as_destroy(child_addrspace);
+		goto error;
+	}
+
 
 	// Acquire lock for atomicity
 	lock_acquire(process_lock);	
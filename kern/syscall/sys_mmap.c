@@ -0,0 +1,288 @@
+/*
+ * mmap and munmap.
+ *
+ * Every mapping is a region of its own (VR_ANON or VR_FILE), placed in
+ * the hole between the most the heap can grow to and the stack. Nothing
+ * is mapped up front. Anonymous pages are zero-filled on first touch
+ * like the heap. File pages fault in as ELF PTEs and are read straight
+ * into the user page with VOP_READ (mmap_load_page), so a clean file
+ * page can be dropped and read in again instead of going to swap.
+ *
+ * There is no file table, so the file is named by path and the region
+ * holds it open. Writes to a private mapping never reach the file.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <kern/unistd.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <uio.h>
+#include <syscall.h>
+#include <thread.h>
+#include <curthread.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <addrspace.h>
+
+
+int
+mmap_load_page(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr)
+{
+	struct uio ku;
+
+	assert(vr->vr_type == VR_FILE);
+	assert(vaddr % PAGE_SIZE == 0);
+
+	// A short read is the end of the file, the rest stays zero
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	mk_kuio(&ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		vr->vr_offset + (vaddr - vr->vr_start), UIO_READ);
+	return VOP_READ(vr->vr_vnode, &ku);
+}
+
+/*
+ * Lowest free range of npages pages above the heap's limit.
+ * Returns 0 if there is none.
+ */
+static
+vaddr_t
+mmap_place(struct addrspace *as, size_t npages)
+{
+	struct vm_region *vr;
+	vaddr_t start, end;
+
+	assert(as->as_heap != NULL);
+	start = as->as_heap->vr_start + HEAP_MAXPAGE * PAGE_SIZE;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next){
+		end = start + npages * PAGE_SIZE;
+		if (end < start){
+			return 0;
+		}
+		if (VR_END(vr) <= start){
+			continue;
+		}
+		if (vr->vr_start >= end){
+			break;
+		}
+		start = VR_END(vr);
+	}
+
+	end = start + npages * PAGE_SIZE;
+	if (end < start || end > USERTOP){
+		return 0;
+	}
+	return start;
+}
+
+/*
+ * The path and offset are the 5th and 6th arguments, so they are on the
+ * user stack past the space reserved for the first four.
+ */
+static
+int
+mmap_stackargs(userptr_t sp, char *path, off_t *offset)
+{
+	userptr_t upath;
+	int result;
+
+	result = copyin((userptr_t)((vaddr_t)sp + 16), &upath, sizeof(upath));
+	if (result) {
+		return result;
+	}
+	result = copyin((userptr_t)((vaddr_t)sp + 20), offset, sizeof(*offset));
+	if (result) {
+		return result;
+	}
+	return copyinstr(upath, path, PATH_MAX, NULL);
+}
+
+int
+sys_mmap(void *addr, size_t len, int prot, int flags, userptr_t sp,
+	 int *errno)
+{
+	struct addrspace *as = curthread->t_vmspace;
+	struct vm_region *vr;
+	struct vnode *v;
+	char path[PATH_MAX];
+	off_t offset;
+	size_t npages;
+	vaddr_t start;
+	int share, ptebits, result;
+
+	// Only a hint, we always pick the place
+	(void)addr;
+
+	share = flags & (MAP_SHARED | MAP_PRIVATE);
+	if (len == 0 || len + PAGE_SIZE - 1 < len ||
+	    (share != MAP_SHARED && share != MAP_PRIVATE) ||
+	    (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		*errno = EINVAL;
+		return -1;
+	}
+
+	// Fork copies every page, and writes never go back to the file
+	if (share == MAP_SHARED && (prot & PROT_WRITE)) {
+		*errno = EUNIMP;
+		return -1;
+	}
+
+	ptebits = 0;
+	if (prot & PROT_READ) {
+		ptebits = SET_RDABLE(ptebits);
+	}
+	if (prot & PROT_WRITE) {
+		ptebits = SET_WTABLE(ptebits);
+	}
+	if (prot & PROT_EXEC) {
+		ptebits = SET_XTABLE(ptebits);
+	}
+
+	v = NULL;
+	offset = 0;
+	if ((flags & MAP_ANON) == 0) {
+		result = mmap_stackargs(sp, path, &offset);
+		if (result) {
+			*errno = result;
+			return -1;
+		}
+		if (offset < 0 || offset % PAGE_SIZE != 0) {
+			*errno = EINVAL;
+			return -1;
+		}
+
+		result = vfs_open(path, O_RDONLY, &v);
+		if (result) {
+			*errno = result;
+			return -1;
+		}
+	}
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	start = mmap_place(as, npages);
+	if (start == 0) {
+		if (v != NULL) {
+			vfs_close(v);
+		}
+		*errno = ENOMEM;
+		return -1;
+	}
+
+	vr = as_add_region(as, start, npages, ptebits,
+			   v != NULL ? VR_FILE : VR_ANON);
+	if (vr == NULL) {
+		if (v != NULL) {
+			vfs_close(v);
+		}
+		*errno = ENOMEM;
+		return -1;
+	}
+	vr->vr_vnode = v;
+	vr->vr_offset = offset;
+
+	DEBUG(DB_VM, "mmap: %lu pages at 0x%lx%s%s\n", (unsigned long)npages,
+	      (unsigned long)start, v != NULL ? " from " : "",
+	      v != NULL ? path : "");
+	return (int)start;
+}
+
+/*
+ * Unmap [start, end) from the mapping vr. What is left of vr may be
+ * split in two. Returns ENOMEM if the second half can't be made.
+ */
+static
+int
+munmap_region(struct addrspace *as, struct vm_region *vr,
+	      vaddr_t start, vaddr_t end)
+{
+	struct vm_region *tail;
+	vaddr_t vr_end = VR_END(vr);
+
+	if (start <= vr->vr_start && end >= vr_end) {
+		as_unmap(as, vr->vr_start, vr_end);
+		as_remove_region(as, vr);
+		return 0;
+	}
+
+	if (start <= vr->vr_start) {
+		// The front goes
+		as_unmap(as, vr->vr_start, end);
+		vr->vr_offset += end - vr->vr_start;
+		vr->vr_npages = (vr_end - end) / PAGE_SIZE;
+		vr->vr_start = end;
+		return 0;
+	}
+
+	if (end < vr_end) {
+		// A hole in the middle, the part above it becomes a region
+		// of its own. Make it first so that failing changes nothing.
+		vr->vr_npages = (end - vr->vr_start) / PAGE_SIZE;
+		tail = as_add_region(as, end, (vr_end - end) / PAGE_SIZE,
+				     vr->vr_prot, vr->vr_type);
+		if (tail == NULL) {
+			vr->vr_npages = (vr_end - vr->vr_start) / PAGE_SIZE;
+			return ENOMEM;
+		}
+		if (vr->vr_vnode != NULL) {
+			VOP_INCOPEN(vr->vr_vnode);
+			VOP_INCREF(vr->vr_vnode);
+			tail->vr_vnode = vr->vr_vnode;
+			tail->vr_offset = vr->vr_offset + (end - vr->vr_start);
+		}
+		vr_end = end;
+	}
+
+	// The back goes
+	as_unmap(as, start, vr_end);
+	vr->vr_npages = (start - vr->vr_start) / PAGE_SIZE;
+	return 0;
+}
+
+int
+sys_munmap(void *addr, size_t len)
+{
+	struct addrspace *as = curthread->t_vmspace;
+	struct vm_region *vr, *next;
+	vaddr_t start, end;
+	int result;
+
+	start = (vaddr_t)addr;
+	end = start + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (start % PAGE_SIZE != 0 || len == 0 || end <= start ||
+	    end > USERTOP) {
+		return EINVAL;
+	}
+
+	// Only mappings can be unmapped, not the program, heap or stack
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_start >= end) {
+			break;
+		}
+		if (VR_END(vr) > start && vr->vr_npages > 0 &&
+		    vr->vr_type != VR_ANON && vr->vr_type != VR_FILE) {
+			return EINVAL;
+		}
+	}
+
+	// Nothing mapped in the range is fine
+	vr = as->as_regions;
+	while (vr != NULL && vr->vr_start < end) {
+		next = vr->vr_next;
+		if (VR_END(vr) > start && vr->vr_npages > 0) {
+			result = munmap_region(as, vr, start, end);
+			if (result) {
+				return result;
+			}
+		}
+		vr = next;
+	}
+	as_droptables(as, start, end);
+
+	DEBUG(DB_VM, "munmap: 0x%lx-0x%lx\n", (unsigned long)start,
+	      (unsigned long)end);
+	return 0;
+}
@@ -1,68 +1,53 @@
 #include <types.h>
 #include <kern/errno.h>
-#include <kern/errno.h>
-#include <clock.h>
 #include <lib.h>
 #include <syscall.h>
+#include <thread.h>
+#include <curthread.h>
 #include <addrspace.h>
 #include <vm.h>
 
 
+/*
+ * Move the break by amount bytes and return where it was.
+ *
+ * Growing only makes the heap region bigger, the new pages are
+ * zero-filled on first touch. Shrinking gives back every page wholly
+ * above the new break: frames and swap slots are freed, the TLB
+ * entries dropped, and page tables left empty are freed too.
+ */
 void*
 sys_sbrk(intptr_t amount, int* errno)
 {
-
 	struct addrspace *as = curthread->t_vmspace;
+	struct vm_region *heap = as->as_heap;
+	vaddr_t oldbrk, newbrk, oldtop, newtop;
 
+	oldbrk = as->as_heapbrk;
+	newbrk = oldbrk + amount;
 
-	/* Amount has to be page-aligned */
-	if((amount%PAGE_SIZE) != 0){
+	/* Break wrapped around, or went below the start of the heap */
+	if ((amount < 0 && newbrk > oldbrk) || newbrk < heap->vr_start){
 		*errno = EINVAL;
 		return (void*) -1;
 	}
 
-	/* Amount + heapvtop will go below heapvbase */
-	if ((amount + (as->heapvtop)) < as->heapvbase){
-		*errno = EINVAL;
+	/* Break will go over max heap size */
+	if ((amount > 0 && newbrk < oldbrk) ||
+	    newbrk > heap->vr_start + HEAP_MAXPAGE * PAGE_SIZE){
+		*errno = ENOMEM;
 		return (void*) -1;
 	}
 
-	/* Amount + heapvtop will go over max heap size */
-	if ((amount+ as->heapvtop) > (as->heapvbase + HEAP_MAXPAGE* PAGE_SIZE)){
-		*errno = EINVAL;
-		return (void*)-1;
-	}
-
-
-	int i, pdir_index, ptable_index, curt_pte;
-	vaddr_t old_heapvtop = as->heapvtop;
+	oldtop = VR_END(heap);
+	newtop = (newbrk + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	int page_required = amount/ PAGE_SIZE;
-
-	/* Update pages_required amount of PTE */
-	for(i = 0 ; i < pages_required; i++){
-
-		/* Increment heap_vaddr by PAGE_SIZE */
-		vaddr_t heap_vaddr = as->heapvtop + i* PAGE_SIZE;
-		pdir_index = GET_PDIR(heap_vaddr);
-		ptable_index = GET_PTBL(heap_vaddr);
-
-		/* page table of the vaddr hasnt been initialized yet */
-		if (as->page_directory[pdir_index] == NULL){
-			struct page_table *ptable = kmalloc(sizeof(struct page_table));
-			as->page_directory[pdir_index] = ptable;
-		}
-
-		/* Set up PTE, valid bit should be off, protection bits should be R/W */
-		curt_pte = 0x0;
-		curt_pte = SET_RDABLE(curt_pte);
-		curt_pte = SET_WTABLE(curt_pte);
-
-		as->page_directory[pdir_index]->PTE[ptable_index] = curt_pte;
+	if (newtop < oldtop){
+		as_unmap(as, newtop, oldtop);
+		as_droptables(as, newtop, oldtop);
 	}
+	heap->vr_npages = (newtop - heap->vr_start) / PAGE_SIZE;
+	as->as_heapbrk = newbrk;
 
-	as->heapvtop += pages_required * PAGE_SIZE;
-
-
-	return (void*)old_heapvtop;
+	return (void*)oldbrk;
 }
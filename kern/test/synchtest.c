@@ -8,6 +8,10 @@
 #include <thread.h>
 #include <test.h>
 #include <clock.h>
+#include <curthread.h>
+#include <scheduler.h>
+#include <machine/spl.h>
+#include "opt-mlfq.h"
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
@@ -166,6 +170,8 @@ locktestthread(void *junk, unsigned long num)
 int
 locktest(int nargs, char **args)
 {
+	time_t secs1, secs2;
+	u_int32_t nsecs1, nsecs2, switches;
 	int i, result;
 
 	(void)nargs;
@@ -173,6 +179,8 @@ locktest(int nargs, char **args)
 
 	inititems();
 	kprintf("Starting lock test...\n");
+	gettime(&secs1, &nsecs1);
+	switches = thread_switches;
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, i, locktestthread,
@@ -186,7 +194,11 @@ locktest(int nargs, char **args)
 		P(donesem);
 	}
 
-	kprintf("Lock test done.\n");
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+	kprintf("Lock test done (%lu.%09lu s, %u context switches).\n",
+		(unsigned long) secs2, (unsigned long) nsecs2,
+		thread_switches - switches);
 
 	return 0;
 }
@@ -273,3 +285,245 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Priority inheritance test.
+ *
+ * A low priority thread holds pilock2 while it does some work, a middle
+ * thread holds pilock1 and waits for pilock2, and a high priority thread
+ * waits for pilock1, while a crowd of CPU hogs competes with all of
+ * them. The high thread's priority has to reach the low one through
+ * both locks, so the low thread finishes its work ahead of the hogs and
+ * the high thread waits about as long as the work takes.
+ *
+ * The test fails if the holder never ran at the waiter's priority, or
+ * if the waiter waited more than PI_BOUND times as long as the work
+ * takes alone, plus PI_SLACK ticks for the hogs that share the top
+ * level with the holder until their first quantum runs out.
+ *
+ * Under round-robin every thread has the same priority, so there is
+ * no inversion to bound and the test does not apply.
+ */
+
+#define PI_WORK    200000    // loop iterations of work under pilock2
+#define PI_STEPS   20        // ... split in this many steps
+#define PI_NHOGS   8
+#define PI_BOUND   3
+#define PI_SLACK   (PI_NHOGS + 2)
+
+static struct lock *pilock1;
+static struct lock *pilock2;
+static struct semaphore *pisem;
+
+static volatile int pi_highprio;   // high thread's priority when it blocked
+static volatile int pi_lowbest;    // best priority the low thread ran at
+static volatile int pi_stop;       // set when the hogs may quit
+static time_t pi_waitsecs;         // how long the high thread waited
+static u_int32_t pi_waitnsecs;
+
+static
+void
+pi_work(int n)
+{
+	volatile int i;
+
+	for (i=0; i<n; i++);
+}
+
+static
+u_int32_t
+pi_usecs(time_t secs, u_int32_t nsecs)
+{
+	return secs * 1000000 + nsecs / 1000;
+}
+
+static
+int
+pi_prio(void)
+{
+	int spl, prio;
+
+	spl = splhigh();
+	prio = scheduler_priority(curthread);
+	splx(spl);
+	return prio;
+}
+
+/* Use up CPU until the scheduler puts us below new threads */
+static
+void
+pi_sink(void)
+{
+	int i;
+
+	for (i=0; i<8 && pi_prio() == 0; i++) {
+		pi_work(PI_WORK);
+	}
+}
+
+static
+void
+pilowthread(void *junk, unsigned long num)
+{
+	int i, prio;
+
+	(void)junk;
+	(void)num;
+
+	pi_sink();
+	lock_acquire(pilock2);
+	V(pisem);
+
+	for (i=0; i<PI_STEPS; i++) {
+		pi_work(PI_WORK / PI_STEPS);
+		prio = pi_prio();
+		if (prio < pi_lowbest) {
+			pi_lowbest = prio;
+		}
+	}
+
+	lock_release(pilock2);
+	V(donesem);
+}
+
+static
+void
+pimidthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	pi_sink();
+	lock_acquire(pilock1);
+	V(pisem);
+
+	lock_acquire(pilock2);
+	lock_release(pilock2);
+	lock_release(pilock1);
+	V(donesem);
+}
+
+static
+void
+pihighthread(void *junk, unsigned long num)
+{
+	time_t secs1, secs2;
+	u_int32_t nsecs1, nsecs2;
+
+	(void)junk;
+	(void)num;
+
+	pi_highprio = pi_prio();
+	gettime(&secs1, &nsecs1);
+	lock_acquire(pilock1);
+	gettime(&secs2, &nsecs2);
+	pi_stop = 1;
+	lock_release(pilock1);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &pi_waitsecs, &pi_waitnsecs);
+	V(donesem);
+}
+
+static
+void
+pihogthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!pi_stop) {
+		pi_work(PI_WORK / PI_STEPS);
+	}
+	V(donesem);
+}
+
+static
+void
+pi_fork(const char *name, void (*func)(void *, unsigned long),
+	unsigned long num)
+{
+	int result;
+
+	result = thread_fork(name, NULL, num, func, NULL);
+	if (result) {
+		panic("pritest: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+int
+pritest(int nargs, char **args)
+{
+	time_t secs1, secs2, worksecs;
+	u_int32_t nsecs1, nsecs2, worknsecs, bound, waited;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+#if !OPT_MLFQ
+	kprintf("Priority inheritance test does not apply: the round-robin "
+		"scheduler gives\nevery thread the same priority "
+		"(see options mlfq).\n");
+	return 0;
+#endif
+
+	inititems();
+	if (pilock1==NULL) {
+		pilock1 = lock_create("pilock1");
+		pilock2 = lock_create("pilock2");
+		pisem = sem_create("pisem", 0);
+		if (pilock1 == NULL || pilock2 == NULL || pisem == NULL) {
+			panic("pritest: Out of memory\n");
+		}
+	}
+	kprintf("Starting priority inheritance test...\n");
+
+	// How long the work takes with nobody in the way
+	gettime(&secs1, &nsecs1);
+	pi_work(PI_WORK);
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &worksecs, &worknsecs);
+
+	pi_highprio = -1;
+	pi_lowbest = 1000;
+	pi_stop = 0;
+
+	pi_fork("pilow", pilowthread, 0);
+	P(pisem);
+	pi_fork("pimid", pimidthread, 0);
+	P(pisem);
+	for (i=0; i<PI_NHOGS; i++) {
+		pi_fork("pihog", pihogthread, i);
+	}
+	pi_fork("pihigh", pihighthread, 0);
+
+	for (i=0; i<PI_NHOGS+3; i++) {
+		P(donesem);
+	}
+
+	kprintf("High priority thread waited %lu.%09lu s "
+		"(the work alone takes %lu.%09lu s, %d hogs)\n",
+		(unsigned long) pi_waitsecs, (unsigned long) pi_waitnsecs,
+		(unsigned long) worksecs, (unsigned long) worknsecs, PI_NHOGS);
+	kprintf("High priority %d, lock holder ran at %d\n",
+		pi_highprio, pi_lowbest);
+
+	if (pi_lowbest > pi_highprio) {
+		kprintf("The lock holder never got the waiter's priority\n");
+		kprintf("Test failed\n");
+		return 0;
+	}
+
+	waited = pi_usecs(pi_waitsecs, pi_waitnsecs);
+	bound = PI_BOUND * pi_usecs(worksecs, worknsecs) +
+		PI_SLACK * (1000000 / HZ);
+	if (waited > bound) {
+		kprintf("Waited %u us, more than the bound of %u us\n",
+			waited, bound);
+		kprintf("Test failed\n");
+		return 0;
+	}
+
+	kprintf("Priority inheritance test done.\n");
+	return 0;
+}
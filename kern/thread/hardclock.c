@@ -2,6 +2,7 @@
 #include <lib.h>
 #include <machine/spl.h>
 #include <thread.h>
+#include <scheduler.h>
 #include <clock.h>
 
 /* 
@@ -29,7 +30,10 @@ hardclock(void)
 		thread_wakeup(&lbolt);
 	}
 
-	thread_yield();
+	// The scheduler decides whether the time slice is up
+	if (scheduler_tick()) {
+		thread_yield();
+	}
 }
 
 /*
@@ -1,34 +1,85 @@
 /*
  * Scheduler.
  *
- * The default scheduler is very simple, just a round-robin run queue.
- * You'll want to improve it.
+ * The default scheduler is very simple, just a round-robin run queue,
+ * and hardclock preempts the running thread on every tick.
+ *
+ * With "options mlfq" it is a multi-level feedback queue instead:
+ * MLFQ_LEVELS run queues, level 0 the highest priority. The first
+ * thread of the highest non-empty level runs, round-robin within a
+ * level.
+ *
+ *  - New threads start at level 0.
+ *  - A thread that uses up the quantum of its level drops a level.
+ *    Lower levels have longer quanta, so CPU hogs switch less often.
+ *  - A thread that sleeps before its quantum runs out (waiting for
+ *    I/O, a lock, the user) goes up a level when it is woken.
+ *  - Every MLFQ_BOOST ticks everybody goes back to level 0, so the
+ *    low levels can't starve.
+ *  - The running thread is preempted early when a thread of a higher
+ *    level becomes runnable.
+ *  - A thread holding a lock that a higher level thread is waiting for
+ *    runs at the waiter's level until it lets go (see synch.c). Its own
+ *    level keeps counting down underneath.
  */
 
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <scheduler.h>
 #include <thread.h>
+#include <curthread.h>
 #include <machine/spl.h>
 #include <queue.h>
+#include <vm.h>
+#include "opt-mlfq.h"
 
 /*
  *  Scheduler data
  */
 
+#if OPT_MLFQ
+
+#define MLFQ_LEVELS 4
+#define MLFQ_BOOST  HZ     // ticks between priority boosts
+
+// Quantum of each level, in ticks
+static const int mlfq_quantum[MLFQ_LEVELS] = { 1, 2, 4, 8 };
+
+// Queues of runnable threads, one per level
+static struct queue *runqueues[MLFQ_LEVELS];
+
+static u_int32_t mlfq_boosts;   // boosts so far, see t_boost
+static int mlfq_ticks;          // ticks since the last boost
+
+#else
+
 // Queue of runnable threads
 static struct queue *runqueue;
 
+#endif /* OPT_MLFQ */
+
 /*
  * Setup function
  */
 void
 scheduler_bootstrap(void)
 {
+#if OPT_MLFQ
+	int i;
+
+	for (i = 0; i < MLFQ_LEVELS; i++) {
+		runqueues[i] = q_create(32);
+		if (runqueues[i] == NULL) {
+			panic("scheduler: Could not create run queue\n");
+		}
+	}
+#else
 	runqueue = q_create(32);
 	if (runqueue == NULL) {
 		panic("scheduler: Could not create run queue\n");
 	}
+#endif
 }
 
 /*
@@ -42,7 +93,22 @@ int
 scheduler_preallocate(int nthreads)
 {
 	assert(curspl>0);
+#if OPT_MLFQ
+	{
+		int i, result;
+
+		// Any thread may end up on any level
+		for (i = 0; i < MLFQ_LEVELS; i++) {
+			result = q_preallocate(runqueues[i], nthreads);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+#else
 	return q_preallocate(runqueue, nthreads);
+#endif
 }
 
 /*
@@ -55,10 +121,24 @@ void
 scheduler_killall(void)
 {
 	assert(curspl>0);
+#if OPT_MLFQ
+	{
+		int i;
+
+		for (i = 0; i < MLFQ_LEVELS; i++) {
+			while (!q_empty(runqueues[i])) {
+				struct thread *t = q_remhead(runqueues[i]);
+				kprintf("scheduler: Dropping thread %s.\n",
+					t->t_name);
+			}
+		}
+	}
+#else
 	while (!q_empty(runqueue)) {
 		struct thread *t = q_remhead(runqueue);
 		kprintf("scheduler: Dropping thread %s.\n", t->t_name);
 	}
+#endif
 }
 
 /*
@@ -74,8 +154,142 @@ scheduler_shutdown(void)
 	scheduler_killall();
 
 	assert(curspl>0);
+#if OPT_MLFQ
+	{
+		int i;
+
+		for (i = 0; i < MLFQ_LEVELS; i++) {
+			q_destroy(runqueues[i]);
+			runqueues[i] = NULL;
+		}
+	}
+#else
 	q_destroy(runqueue);
 	runqueue = NULL;
+#endif
+}
+
+#if OPT_MLFQ
+/* Level t runs at: its own, or a better one inherited through a lock */
+static
+int
+mlfq_level(struct thread *t)
+{
+	if (t->t_inherit >= 0 && t->t_inherit < t->t_level) {
+		return t->t_inherit;
+	}
+	return t->t_level;
+}
+
+/* Take the runnable thread t off the queue it is on */
+static
+void
+mlfq_dequeue(struct thread *t)
+{
+	struct queue *q = runqueues[t->t_queued];
+	struct thread *x;
+	int n, result;
+
+	// The queue can only take from the head, so go round it once
+	n = (q_getend(q) - q_getstart(q) + q_getsize(q)) % q_getsize(q);
+	while (n-- > 0) {
+		x = q_remhead(q);
+		if (x != t) {
+			// We just made room for it
+			result = q_addtail(q, x);
+			assert(result == 0);
+		}
+	}
+	t->t_queued = -1;
+}
+
+/* Level of the highest non-empty run queue, -1 if all are empty */
+static
+int
+mlfq_toplevel(void)
+{
+	int i;
+
+	for (i = 0; i < MLFQ_LEVELS; i++) {
+		if (!q_empty(runqueues[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Put every runnable thread, and the current one, back on level 0 */
+static
+void
+mlfq_boost(void)
+{
+	struct thread *t;
+	int i, result;
+
+	mlfq_boosts++;
+	for (i = 1; i < MLFQ_LEVELS; i++) {
+		while (!q_empty(runqueues[i])) {
+			t = q_remhead(runqueues[i]);
+			t->t_level = 0;
+			t->t_ticks = 0;
+			t->t_boost = mlfq_boosts;
+			t->t_queued = 0;
+			// Preallocated, see scheduler_preallocate
+			result = q_addtail(runqueues[0], t);
+			assert(result == 0);
+		}
+	}
+
+	// Sleeping threads catch up in make_runnable. There is no
+	// current thread if the tick came in while idle.
+	if (curthread != NULL) {
+		curthread->t_level = 0;
+		curthread->t_ticks = 0;
+		curthread->t_boost = mlfq_boosts;
+	}
+}
+#endif /* OPT_MLFQ */
+
+/*
+ * Called by hardclock on every tick. Returns nonzero if the current
+ * thread should give up the processor.
+ */
+int
+scheduler_tick(void)
+{
+	assert(curspl>0);
+
+#if OPT_MLFQ
+	{
+		int top;
+
+		if (++mlfq_ticks >= MLFQ_BOOST) {
+			mlfq_ticks = 0;
+			mlfq_boost();
+			return curthread != NULL;
+		}
+
+		// Idle, in the middle of mi_switch; nobody to charge
+		if (curthread == NULL) {
+			return 0;
+		}
+
+		// Used up its quantum: round-robin, one level down
+		if (++curthread->t_ticks >= mlfq_quantum[curthread->t_level]) {
+			if (curthread->t_level < MLFQ_LEVELS - 1) {
+				curthread->t_level++;
+			}
+			curthread->t_ticks = 0;
+			return 1;
+		}
+
+		// Something more important is waiting
+		top = mlfq_toplevel();
+		return top != -1 && top < mlfq_level(curthread);
+	}
+#else
+	return 1;
+#endif
 }
 
 /*
@@ -90,8 +304,21 @@ scheduler(void)
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
+#if OPT_MLFQ
+	while (mlfq_toplevel() == -1) {
+#else
 	while (q_empty(runqueue)) {
-		cpu_idle();
+#endif
+		// Use the idle time to zero free pages ahead of time.
+		// Let pending interrupts in after each page, so a
+		// thread that became runnable doesn't wait for the
+		// whole pool.
+		if (vm_prezero()) {
+			splx(spl0());
+		}
+		else {
+			cpu_idle();
+		}
 	}
 
 	// You can actually uncomment this to see what the scheduler's
@@ -101,12 +328,21 @@ scheduler(void)
 	// 
 	//print_run_queue();
 	
+#if OPT_MLFQ
+	{
+		struct thread *t = q_remhead(runqueues[mlfq_toplevel()]);
+		t->t_queued = -1;
+		return t;
+	}
+#else
 	return q_remhead(runqueue);
+#endif
 }
 
 /* 
  * Make a thread runnable.
  * With the base scheduler, just add it to the end of the run queue.
+ * With MLFQ, add it to the end of the queue for its level.
  */
 int
 make_runnable(struct thread *t)
@@ -114,7 +350,66 @@ make_runnable(struct thread *t)
 	// meant to be called with interrupts off
 	assert(curspl>0);
 
+#if OPT_MLFQ
+	if (t->t_boost != mlfq_boosts) {
+		// Asleep or new when the last boost went by
+		t->t_level = 0;
+		t->t_ticks = 0;
+		t->t_boost = mlfq_boosts;
+	}
+	else if (t->t_sleepaddr != NULL) {
+		// Being woken up (thread_wakeup leaves the sleep address
+		// set), so it blocked before its quantum ran out
+		if (t->t_level > 0) {
+			t->t_level--;
+		}
+		t->t_ticks = 0;
+	}
+	t->t_queued = mlfq_level(t);
+	return q_addtail(runqueues[t->t_queued], t);
+#else
 	return q_addtail(runqueue, t);
+#endif
+}
+
+/*
+ * Priority of t for priority inheritance; lower numbers run first.
+ * Under round-robin every thread has the same priority.
+ */
+int
+scheduler_priority(struct thread *t)
+{
+	assert(curspl>0);
+#if OPT_MLFQ
+	return mlfq_level(t);
+#else
+	(void)t;
+	return 0;
+#endif
+}
+
+/*
+ * Let t run at priority prio, inherited from a thread waiting on a lock
+ * t holds, or drop whatever it inherited if prio is -1. A runnable t
+ * moves to the queue of its new level.
+ */
+void
+scheduler_inherit(struct thread *t, int prio)
+{
+	assert(curspl>0);
+
+	t->t_inherit = prio;
+#if OPT_MLFQ
+	if (t->t_queued >= 0 && t->t_queued != mlfq_level(t)) {
+		int result;
+
+		mlfq_dequeue(t);
+		t->t_queued = mlfq_level(t);
+		// Preallocated, see scheduler_preallocate
+		result = q_addtail(runqueues[t->t_queued], t);
+		assert(result == 0);
+	}
+#endif
 }
 
 /*
@@ -127,6 +422,23 @@ print_run_queue(void)
 	int spl = splhigh();
 
 	int i,k=0;
+#if OPT_MLFQ
+	int level;
+
+	for (level = 0; level < MLFQ_LEVELS; level++) {
+		struct queue *runqueue = runqueues[level];
+
+		kprintf(" level %d (%d ticks):\n", level, mlfq_quantum[level]);
+		i = q_getstart(runqueue);
+		while (i!=q_getend(runqueue)) {
+			struct thread *t = q_getguy(runqueue, i);
+			kprintf("  %2d: %s %p\n", k, t->t_name,
+				t->t_sleepaddr);
+			i=(i+1)%q_getsize(runqueue);
+			k++;
+		}
+	}
+#else
 	i = q_getstart(runqueue);
 	
 	while (i!=q_getend(runqueue)) {
@@ -135,6 +447,7 @@ print_run_queue(void)
 		i=(i+1)%q_getsize(runqueue);
 		k++;
 	}
+#endif
 	
 	splx(spl);
 }
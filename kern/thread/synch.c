@@ -8,8 +8,243 @@
 #include <synch.h>
 #include <thread.h>
 #include <curthread.h>
+#include <scheduler.h>
+#include <clock.h>
 #include <machine/spl.h>
 
+////////////////////////////////////////////////////////////
+//
+// Contention profiling.
+
+#define SYNCHPROF_MAXTOP  16    // most primitives synchprof_print lists
+#define SYNCHPROF_NAMELEN 24
+
+static struct synchprof *synchprof_all;   // every sem, lock and CV
+static int synchprof_timing;              // also time waits and holds
+
+static
+void
+synchprof_clear(struct synchprof *sp)
+{
+	sp->sp_acquires = 0;
+	sp->sp_contended = 0;
+	sp->sp_waitsecs = 0;
+	sp->sp_waitus = 0;
+	sp->sp_maxwaitus = 0;
+	sp->sp_holdsecs = 0;
+	sp->sp_holdus = 0;
+	sp->sp_maxholdus = 0;
+}
+
+static
+void
+synchprof_register(struct synchprof *sp, const char *kind, const char *name)
+{
+	int spl;
+
+	sp->sp_kind = kind;
+	sp->sp_name = name;
+	sp->sp_holding = 0;
+	synchprof_clear(sp);
+
+	spl = splhigh();
+	sp->sp_prev = NULL;
+	sp->sp_next = synchprof_all;
+	if (synchprof_all != NULL) {
+		synchprof_all->sp_prev = sp;
+	}
+	synchprof_all = sp;
+	splx(spl);
+}
+
+static
+void
+synchprof_unregister(struct synchprof *sp)
+{
+	int spl;
+
+	spl = splhigh();
+	if (sp->sp_prev == NULL) {
+		synchprof_all = sp->sp_next;
+	}
+	else {
+		sp->sp_prev->sp_next = sp->sp_next;
+	}
+	if (sp->sp_next != NULL) {
+		sp->sp_next->sp_prev = sp->sp_prev;
+	}
+	splx(spl);
+}
+
+/* Note the time in secs/nsecs if timing is on. Returns nonzero if so. */
+static
+int
+synchprof_start(time_t *secs, u_int32_t *nsecs)
+{
+	if (!synchprof_timing) {
+		return 0;
+	}
+	gettime(secs, nsecs);
+	return 1;
+}
+
+/* Microseconds since secs/nsecs, 0xffffffff if that doesn't fit */
+static
+u_int32_t
+synchprof_since(time_t secs, u_int32_t nsecs)
+{
+	time_t now, rsecs;
+	u_int32_t nownsecs, rnsecs;
+
+	gettime(&now, &nownsecs);
+	getinterval(secs, nsecs, now, nownsecs, &rsecs, &rnsecs);
+	if (rsecs < 0) {
+		return 0;
+	}
+	if ((u_int32_t)rsecs >= 0xffffffff / 1000000) {
+		return 0xffffffff;
+	}
+	return (u_int32_t)rsecs * 1000000 + rnsecs / 1000;
+}
+
+/* Add us microseconds to the total in secs and usecs */
+static
+void
+synchprof_add(u_int32_t *secs, u_int32_t *usecs, u_int32_t us)
+{
+	*secs += us / 1000000;
+	*usecs += us % 1000000;
+	if (*usecs >= 1000000) {
+		*secs += 1;
+		*usecs -= 1000000;
+	}
+}
+
+/* Done sleeping since secs/nsecs */
+static
+void
+synchprof_waited(struct synchprof *sp, time_t secs, u_int32_t nsecs)
+{
+	u_int32_t us = synchprof_since(secs, nsecs);
+
+	synchprof_add(&sp->sp_waitsecs, &sp->sp_waitus, us);
+	if (us > sp->sp_maxwaitus) {
+		sp->sp_maxwaitus = us;
+	}
+}
+
+/* A lock was just taken */
+static
+void
+synchprof_hold(struct synchprof *sp)
+{
+	sp->sp_holding = synchprof_start(&sp->sp_startsecs,
+					 &sp->sp_startnsecs);
+}
+
+/* ... and is being let go */
+static
+void
+synchprof_unhold(struct synchprof *sp)
+{
+	u_int32_t us;
+
+	if (sp->sp_holding) {
+		us = synchprof_since(sp->sp_startsecs, sp->sp_startnsecs);
+		synchprof_add(&sp->sp_holdsecs, &sp->sp_holdus, us);
+		if (us > sp->sp_maxholdus) {
+			sp->sp_maxholdus = us;
+		}
+		sp->sp_holding = 0;
+	}
+}
+
+/* Turn timing on or off. Turning it on starts all the counts over. */
+void
+synchprof_settiming(int on)
+{
+	struct synchprof *sp;
+	int spl;
+
+	spl = splhigh();
+	if (on) {
+		for (sp = synchprof_all; sp != NULL; sp = sp->sp_next) {
+			synchprof_clear(sp);
+		}
+	}
+	synchprof_timing = on;
+	splx(spl);
+}
+
+/* Nonzero if a is more contended than b */
+static
+int
+synchprof_worse(const struct synchprof *a, const struct synchprof *b)
+{
+	if (a->sp_contended != b->sp_contended) {
+		return a->sp_contended > b->sp_contended;
+	}
+	if (a->sp_waitsecs != b->sp_waitsecs) {
+		return a->sp_waitsecs > b->sp_waitsecs;
+	}
+	return a->sp_waitus > b->sp_waitus;
+}
+
+void
+synchprof_print(int n)
+{
+	struct synchprof top[SYNCHPROF_MAXTOP];
+	char names[SYNCHPROF_MAXTOP][SYNCHPROF_NAMELEN];
+	struct synchprof *sp;
+	int i, j, ntop, spl;
+
+	if (n > SYNCHPROF_MAXTOP) {
+		n = SYNCHPROF_MAXTOP;
+	}
+
+	/*
+	 * Copy the n worst out, names too, so they can be printed with
+	 * interrupts on even if the primitive goes away meanwhile.
+	 */
+	ntop = 0;
+	spl = splhigh();
+	for (sp = synchprof_all; sp != NULL; sp = sp->sp_next) {
+		if (sp->sp_acquires == 0) {
+			continue;
+		}
+		for (i = ntop; i > 0 && synchprof_worse(sp, &top[i-1]); i--) {
+			if (i < n) {
+				top[i] = top[i-1];
+				strcpy(names[i], names[i-1]);
+			}
+		}
+		if (i < n) {
+			top[i] = *sp;
+			snprintf(names[i], SYNCHPROF_NAMELEN, "%s",
+				 sp->sp_name);
+			if (ntop < n) {
+				ntop++;
+			}
+		}
+	}
+	splx(spl);
+
+	kprintf("%-20s %-4s %8s %8s %13s %10s %13s %10s\n", "name", "kind",
+		"acquires", "waits", "wait s", "max us", "hold s", "max us");
+	for (j = 0; j < ntop; j++) {
+		kprintf("%-20s %-4s %8u %8u %6u.%06u %10u %6u.%06u %10u\n",
+			names[j], top[j].sp_kind, top[j].sp_acquires,
+			top[j].sp_contended,
+			top[j].sp_waitsecs, top[j].sp_waitus,
+			top[j].sp_maxwaitus,
+			top[j].sp_holdsecs, top[j].sp_holdus,
+			top[j].sp_maxholdus);
+	}
+	if (!synchprof_timing) {
+		kprintf("(timing is off, see \"lockstat on\")\n");
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -33,6 +268,7 @@ sem_create(const char *namearg, int initial_count)
 	}
 
 	sem->count = initial_count;
+	synchprof_register(&sem->sem_prof, "sem", sem->name);
 	return sem;
 }
 
@@ -55,6 +291,7 @@ sem_destroy(struct semaphore *sem)
 	 * including the kfrees in the splhigh block, so we don't.
 	 */
 
+	synchprof_unregister(&sem->sem_prof);
 	kfree(sem->name);
 	kfree(sem);
 }
@@ -62,7 +299,9 @@ sem_destroy(struct semaphore *sem)
 void 
 P(struct semaphore *sem)
 {
-	int spl;
+	time_t secs;
+	u_int32_t nsecs;
+	int spl, timed;
 	assert(sem != NULL);
 
 	/*
@@ -74,8 +313,16 @@ P(struct semaphore *sem)
 	assert(in_interrupt==0);
 
 	spl = splhigh();
-	while (sem->count==0) {
-		thread_sleep(sem);
+	sem->sem_prof.sp_acquires++;
+	if (sem->count==0) {
+		sem->sem_prof.sp_contended++;
+		timed = synchprof_start(&secs, &nsecs);
+		while (sem->count==0) {
+			thread_sleep(sem);
+		}
+		if (timed) {
+			synchprof_waited(&sem->sem_prof, secs, nsecs);
+		}
 	}
 	assert(sem->count>0);
 	sem->count--;
@@ -113,6 +360,9 @@ V1(struct semaphore *sem)
 const int IS_HELD = 1;
 const int  NO_HELD = 0;
 
+// Longest chain of locks a priority is passed along; stops deadlock loops
+#define LOCK_MAXDONATE 16
+
 struct lock *
 lock_create(const char *name)
 {
@@ -133,6 +383,10 @@ lock_create(const char *name)
 	// initialize lock to be "free"
 	lock->held = NO_HELD;
 	lock->holding_thread = NULL;
+	lock->lk_nextheld = NULL;
+	lock->lk_waithead = NULL;
+	lock->lk_waittail = NULL;
+	synchprof_register(&lock->lk_prof, "lock", lock->name);
 
 
 	// initialize lock queue
@@ -147,15 +401,73 @@ lock_destroy(struct lock *lock)
 	assert(lock != NULL);
 
 	// add stuff here as needed
+	assert(lock->lk_waithead == NULL);
+	synchprof_unregister(&lock->lk_prof);
 	
 	kfree(lock->name);
 	kfree(lock->holding_thread);
 	kfree(lock);
 }
 
+/*
+ * Lend priority prio to the holder of lock, and on down the chain of
+ * locks the holders are waiting for.
+ */
+static
+void
+lock_donate(struct lock *lock, int prio)
+{
+	struct thread *holder;
+	int depth;
+
+	for (depth = 0; lock != NULL && depth < LOCK_MAXDONATE; depth++) {
+		holder = lock->holding_thread;
+		if (holder == NULL || scheduler_priority(holder) <= prio) {
+			break;
+		}
+		scheduler_inherit(holder, prio);
+		lock = holder->t_waitlock;
+	}
+}
+
+/* Best priority among prio and the threads waiting for lock */
+static
+int
+lock_waiterprio(struct lock *lock, int prio)
+{
+	struct thread *t;
+	int p;
+
+	for (t = lock->lk_waithead; t != NULL; t = t->t_waitnext) {
+		p = scheduler_priority(t);
+		if (prio < 0 || p < prio) {
+			prio = p;
+		}
+	}
+	return prio;
+}
+
+/* Best priority curthread may keep from the waiters of locks it holds */
+static
+int
+lock_inherited(void)
+{
+	struct lock *l;
+	int prio = -1;
+
+	for (l = curthread->t_heldlocks; l != NULL; l = l->lk_nextheld) {
+		prio = lock_waiterprio(l, prio);
+	}
+	return prio;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	time_t secs;
+	u_int32_t nsecs;
+	int timed;
+
 	// Write this
 
 	assert(lock != NULL);
@@ -163,13 +475,43 @@ lock_acquire(struct lock *lock)
 	// disable interrupts
 	int s = splhigh();
 	
-	while (lock->held == IS_HELD)
+	lock->lk_prof.sp_acquires++;
+	if (lock->held == IS_HELD)
 	{	
-		thread_sleep (lock);
+		lock->lk_prof.sp_contended++;
+		timed = synchprof_start(&secs, &nsecs);
+
+		// get in line; lock_release hands the lock to us
+		curthread->t_waitlock = lock;
+		curthread->t_waitnext = NULL;
+		if (lock->lk_waittail == NULL) {
+			lock->lk_waithead = curthread;
+		}
+		else {
+			lock->lk_waittail->t_waitnext = curthread;
+		}
+		lock->lk_waittail = curthread;
+
+		// lend our priority to whoever is in the way
+		lock_donate(lock, scheduler_priority(curthread));
+
+		while (lock->holding_thread != curthread) {
+			thread_sleep (lock);
+		}
+		curthread->t_waitlock = NULL;
+
+		if (timed) {
+			synchprof_waited(&lock->lk_prof, secs, nsecs);
+		}
 	}	
-
-	lock->held = IS_HELD;
-	lock->holding_thread = curthread;
+	else
+	{
+		lock->held = IS_HELD;
+		lock->holding_thread = curthread;
+	}
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+	synchprof_hold(&lock->lk_prof);
 
 	
 	
@@ -181,6 +523,10 @@ lock_acquire(struct lock *lock)
 void
 lock_release(struct lock *lock)
 {
+	struct lock **link;
+	struct thread *next;
+	int prio;
+
 	// Write this
 	//(void) lock;
 
@@ -189,12 +535,46 @@ lock_release(struct lock *lock)
 	// disable interrupts
 	int s = splhigh();
 
+	assert(lock->holding_thread == curthread);
 
-	lock->held = NO_HELD;	
-	lock->holding_thread = NULL;
+	for (link = &curthread->t_heldlocks; *link != lock;
+	     link = &(*link)->lk_nextheld) {
+		assert(*link != NULL);
+	}
+	*link = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+	synchprof_unhold(&lock->lk_prof);
 
-	// wake up waiting threads 
-	thread_wakeone (lock);
+	// give back what the waiters for this lock lent us
+	scheduler_inherit(curthread, lock_inherited());
+
+	next = lock->lk_waithead;
+	if (next == NULL) {
+		lock->held = NO_HELD;	
+		lock->holding_thread = NULL;
+	}
+	else {
+		// hand the lock over, it stays held
+		lock->lk_waithead = next->t_waitnext;
+		if (lock->lk_waithead == NULL) {
+			lock->lk_waittail = NULL;
+		}
+		next->t_waitnext = NULL;
+		next->t_waitlock = NULL;
+		lock->holding_thread = next;
+
+		/*
+		 * Waiters go to sleep in the order they queue up, and
+		 * only they sleep on the lock, so this wakes next.
+		 */
+		thread_wakeone (lock);
+
+		// the rest of the line lends its priority to next now
+		prio = lock_waiterprio(lock, -1);
+		if (prio >= 0) {
+			lock_donate(lock, prio);
+		}
+	}
 
 	// re-enable interrupts if it was enabled before we changed it; else it stays the same
 	splx( s );
@@ -234,6 +614,7 @@ cv_create(const char *name)
 	}
 	
 	// add stuff here as needed
+	synchprof_register(&cv->cv_prof, "cv", cv->name);
 	
 	return cv;
 }
@@ -244,6 +625,7 @@ cv_destroy(struct cv *cv)
 	assert(cv != NULL);
 
 	// add stuff here as needed
+	synchprof_unregister(&cv->cv_prof);
 	
 	kfree(cv->name);
 	kfree(cv);
@@ -252,6 +634,10 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+	time_t secs;
+	u_int32_t nsecs;
+	int timed;
+
 	// Write this
 	// (void)cv;    // suppress warning until code gets written
 	// (void)lock;  // suppress warning until code gets written
@@ -267,8 +653,14 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_release (lock);
 
 	
-	// go to sleep
+	// go to sleep; every wait counts as contended
+	cv->cv_prof.sp_acquires++;
+	cv->cv_prof.sp_contended++;
+	timed = synchprof_start(&secs, &nsecs);
 	thread_sleep (cv);
+	if (timed) {
+		synchprof_waited(&cv->cv_prof, secs, nsecs);
+	}
 	
 	// acquire lock
 	lock_acquire (lock);
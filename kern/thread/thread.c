@@ -29,8 +29,16 @@ typedef enum {
 /* Global variable for the thread currently executing at any given time. */
 struct thread *curthread;
 
-/* Table of sleeping threads. */
-static struct array *sleepers;
+/*
+ * Sleeping threads, hashed by sleep address. Each bucket is a FIFO list
+ * linked through t_sleepnext, so a wakeup only looks at threads whose
+ * address lands in the same bucket, and wakes them in the order they
+ * went to sleep.
+ */
+#define SLEEP_NBUCKETS 64
+
+static struct thread *sleep_head[SLEEP_NBUCKETS];
+static struct thread *sleep_tail[SLEEP_NBUCKETS];
 
 /* List of dead threads to be disposed of. */
 static struct array *zombies;
@@ -38,6 +46,9 @@ static struct array *zombies;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/* Context switches to a different thread so far, for the lock tests. */
+u_int32_t thread_switches;
+
 
 /* FOR NEXT LAB
 struct file_table *create_ft(struct vnode *v, int permission, off_t offset){
@@ -76,7 +87,16 @@ thread_create(const char *name)
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
+	thread->t_sleepnext = NULL;
 	thread->t_stack = NULL;
+	thread->t_level = 0;
+	thread->t_ticks = 0;
+	thread->t_boost = 0;
+	thread->t_queued = -1;
+	thread->t_inherit = -1;
+	thread->t_waitlock = NULL;
+	thread->t_waitnext = NULL;
+	thread->t_heldlocks = NULL;
 	
 	thread->t_vmspace = NULL;
 
@@ -87,6 +107,7 @@ thread_create(const char *name)
 
 	thread-> exit_status = 0;
 	thread-> exit_code = 0;
+	thread-> t_oomkilled = 0;
 
 	thread-> childpid_array = NULL;
 
@@ -170,6 +191,50 @@ exorcise(void)
 	assert(result==0);
 }
 
+static
+unsigned
+sleep_hash(const void *addr)
+{
+	u_int32_t a = (u_int32_t)addr;
+
+	// Sleep addresses are mostly kmalloc'd objects, so skip the low bits
+	return ((a >> 4) ^ (a >> 10)) % SLEEP_NBUCKETS;
+}
+
+/* Put t at the back of the bucket for its sleep address */
+static
+void
+sleep_enqueue(struct thread *t)
+{
+	unsigned b = sleep_hash(t->t_sleepaddr);
+
+	t->t_sleepnext = NULL;
+	if (sleep_tail[b] == NULL) {
+		sleep_head[b] = t;
+	}
+	else {
+		sleep_tail[b]->t_sleepnext = t;
+	}
+	sleep_tail[b] = t;
+}
+
+/* Take t, which comes after prev (NULL if first), out of bucket b */
+static
+void
+sleep_unlink(unsigned b, struct thread *prev, struct thread *t)
+{
+	if (prev == NULL) {
+		sleep_head[b] = t->t_sleepnext;
+	}
+	else {
+		prev->t_sleepnext = t->t_sleepnext;
+	}
+	if (sleep_tail[b] == t) {
+		sleep_tail[b] = prev;
+	}
+	t->t_sleepnext = NULL;
+}
+
 /*
  * Kill all sleeping threads. This is used during panic shutdown to make 
  * sure they don't wake up again and interfere with the panic.
@@ -178,7 +243,8 @@ static
 void
 thread_killall(void)
 {
-	int i, result;
+	struct thread *t;
+	int i;
 
 	assert(curspl>0);
 
@@ -187,23 +253,21 @@ thread_killall(void)
 	 * wake up while we're shutting down.
 	 */
 
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		kprintf("sleep: Dropping thread %s\n", t->t_name);
+	for (i=0; i<SLEEP_NBUCKETS; i++) {
+		for (t = sleep_head[i]; t != NULL; t = t->t_sleepnext) {
+			kprintf("sleep: Dropping thread %s\n", t->t_name);
 
-		/*
-		 * Don't do this: because these threads haven't
-		 * been through thread_exit, thread_destroy will
-		 * get upset. Just drop the threads on the floor,
-		 * which is safer anyway during panic.
-		 *
-		 * array_add(zombies, t);
-		 */
+			/*
+			 * Don't do this: because these threads haven't
+			 * been through thread_exit, thread_destroy will
+			 * get upset. Just drop the threads on the floor,
+			 * which is safer anyway during panic.
+			 *
+			 * array_add(zombies, t);
+			 */
+		}
+		sleep_head[i] = sleep_tail[i] = NULL;
 	}
-
-	result = array_setsize(sleepers, 0);
-	/* shrinking array: not supposed to fail */
-	assert(result==0);
 }
 
 /*
@@ -236,11 +300,6 @@ thread_bootstrap(void)
 
 
 	/* Create the data structures we need. */
-	sleepers = array_create();
-	if (sleepers==NULL) {
-		panic("Cannot create sleepers array\n");
-	}
-
 	zombies = array_create();
 	if (zombies==NULL) {
 		panic("Cannot create zombies array\n");
@@ -301,8 +360,6 @@ thread_bootstrap(void)
 void
 thread_shutdown(void)
 {
-	array_destroy(sleepers);
-	sleepers = NULL;
 	array_destroy(zombies);
 	zombies = NULL;
 
@@ -363,10 +420,6 @@ thread_fork(const char *name,
 	 * Make sure our data structures have enough space, so we won't
 	 * run out later at an inconvenient time.
 	 */
-	result = array_preallocate(sleepers, numthreads+1);
-	if (result) {
-		goto fail;
-	}
 	result = array_preallocate(zombies, numthreads+1);
 	if (result) {
 		goto fail;
@@ -466,11 +519,9 @@ mi_switch(threadstate_t nextstate)
 		result = make_runnable(cur);
 	}
 	else if (nextstate==S_SLEEP) {
-		/*
-		 * Because we preallocate sleepers[] during thread_fork,
-		 * this should never fail.
-		 */
-		result = array_add(sleepers, cur);
+		/* The wait lists are linked through the thread itself */
+		sleep_enqueue(cur);
+		result = 0;
 	}
 	else {
 		assert(nextstate==S_ZOMB);
@@ -486,6 +537,9 @@ mi_switch(threadstate_t nextstate)
 
 	/* update curthread */
 	curthread = next;
+	if (next != cur) {
+		thread_switches++;
+	}
 	
 	/* 
 	 * Call the machine-dependent code that actually does the
@@ -583,8 +637,8 @@ thread_yield(void)
 {
 	int spl = splhigh();
 
-	/* Check sleepers just in case we get here after shutdown */
-	assert(sleepers != NULL);
+	/* Check zombies just in case we get here after shutdown */
+	assert(zombies != NULL);
 
 	mi_switch(S_READY);
 	splx(spl);
@@ -619,56 +673,56 @@ thread_sleep(const void *addr)
 void
 thread_wakeup(const void *addr)
 {
-	int i, result;
+	struct thread *t, *prev, *next;
+	unsigned b;
+	int result;
 	
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		if (t->t_sleepaddr == addr) {
-			
-			// Remove from list
-			array_remove(sleepers, i);
-			
-			// must look at the same sleepers[i] again
-			i--;
-
-			/*
-			 * Because we preallocate during thread_fork,
-			 * this should never fail.
-			 */
-			result = make_runnable(t);
-			assert(result==0);
+	b = sleep_hash(addr);
+	prev = NULL;
+	for (t = sleep_head[b]; t != NULL; t = next) {
+		next = t->t_sleepnext;
+		if (t->t_sleepaddr != addr) {
+			prev = t;
+			continue;
 		}
+
+		// Remove from list
+		sleep_unlink(b, prev, t);
+
+		/*
+		 * Because we preallocate during thread_fork,
+		 * this should never fail. t_sleepaddr is still
+		 * set, so the scheduler can tell this is a wakeup.
+		 */
+		result = make_runnable(t);
+		assert(result==0);
 	}
 }
 
 /*
  * Wake up ONLY ONE thread  sleeping on "sleep address"
- * ADDR.
+ * ADDR. The one that has been sleeping longest goes first.
  */
 void
 thread_wakeone(const void *addr)
 {
-	int i, result;
+	struct thread *t, *prev;
+	unsigned b;
+	int result;
 	
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
+	b = sleep_hash(addr);
+	prev = NULL;
+	for (t = sleep_head[b]; t != NULL; t = t->t_sleepnext) {
 		if (t->t_sleepaddr == addr) {
 			
 			// Remove from list
-			array_remove(sleepers, i);
-			
-			// must look at the same sleepers[i] again
-			i--;
+			sleep_unlink(b, prev, t);
 
 			/*
 			 * Because we preallocate during thread_fork,
@@ -678,6 +732,7 @@ thread_wakeone(const void *addr)
 			assert(result==0);
 			return;
 		}
+		prev = t;
 	}
 }
 
@@ -688,13 +743,12 @@ thread_wakeone(const void *addr)
 int
 thread_hassleepers(const void *addr)
 {
-	int i;
+	struct thread *t;
 	
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
+	for (t = sleep_head[sleep_hash(addr)]; t != NULL; t = t->t_sleepnext) {
 		if (t->t_sleepaddr == addr) {
 			return 1;
 		}
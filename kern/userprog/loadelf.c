@@ -1,11 +1,10 @@
 /*
  * Code to load an ELF-format executable into the current address space.
  *
- * Right now it just copies into userspace and hopes the addresses are
- * mappable to real memory. This works with dumbvm; however, when you
- * write a real VM system, you will need to either (1) add code that
- * makes the address range used for load valid, or (2) if you implement
- * memory-mapped files, map each segment instead of copying it into RAM.
+ * Nothing is copied at load time. Each segment is recorded in the
+ * address space and its pages get ELF PTEs; vm_fault reads a page in
+ * from the executable when it is first touched, so starting a program
+ * costs time in proportion to the pages it uses, not its size.
  */
 
 #include <types.h>
@@ -17,258 +16,131 @@
 #include <thread.h>
 #include <curthread.h>
 #include <vnode.h>
+#include <vm.h>
+#include <machine/spl.h>
 
 /*
- * Load a segment at virtual address VADDR. The segment in memory
+ * Set up a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
  * segment on disk is located at file offset OFFSET and has length
  * FILESIZE.
  *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
+ * Nothing is read here. The segment is remembered in the address space
+ * and every page it covers gets an ELF PTE, so vm_fault reads each page
+ * in (via load_elf_page) the first time it is touched.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * We don't go through uiomove anymore, so check here that the segment
+ * stays out of kernel space.
  */
 static
 int
-load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
+define_segment(struct addrspace *as, off_t offset, vaddr_t vaddr,
+	       size_t memsize, size_t filesize,
+	       int readable, int writeable, int executable)
 {
-	struct uio u;
-	int result;
-	size_t fillamt;
+	struct elf_segment *seg;
+	vaddr_t page, top;
+	int prot, spl;
+	int *pte;
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	u.uio_iovec.iov_ubase = (userptr_t)vaddr;
-	u.uio_iovec.iov_len = memsize;   // length of the memory space
-	u.uio_resid = filesize;          // amount to actually read
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = curthread->t_vmspace;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
+	top = vaddr + memsize;
+	if (top < vaddr || top > USERTOP) {
+		return EFAULT;
 	}
 
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
+	if (as->as_nsegs == ELF_MAXSEGS) {
+		kprintf("ELF: too many segments\n");
 		return ENOEXEC;
 	}
 
-	/* Fill the rest of the memory space (if any) with zeros */
-	fillamt = memsize - filesize;
-	if (fillamt > 0) {
-		DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-		      (unsigned long) fillamt);
-		u.uio_resid += fillamt;
-		result = uiomovezeros(fillamt, &u);
-	}
-
-	return result;
-}
-
-
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes (%lu from file) at 0x%lx\n",
+	      (unsigned long) memsize, (unsigned long) filesize,
+	      (unsigned long) vaddr);
 
+	seg = &as->as_segs[as->as_nsegs++];
+	seg->es_vaddr = vaddr;
+	seg->es_memsize = memsize;
+	seg->es_filesize = filesize;
+	seg->es_offset = offset;
 
-/* Load page segment */
-static
-int
-define_segment_pte(struct vnode *v, off_t __offset, vaddr_t __vaddr,
-		     size_t __memsize, size_t __filesize,
-		     int __is_executable)
-{
-	assert(v != NULL);
-
-	int curt_pte = 0x0;
-	int result;
-	off_t offset = __offset;
-	vaddr_t vaddr = __vaddr;
-	size_t memsize = __memsize;
-	size_t filesize = __filesize;
-
-
- 	/* If only 1 PTE needs to have valid filesize bits */
-	if (filesize + (vaddr & PAGE_FRAME) < PAGE_SIZE){
-
-		/* If memsize + offset exceeds one page, then firstmemsz is PAGE_SIZE - vaddr offset */
-		size_t firstmemsz = ((memsize + (vaddr & PAGE_FRAME)) => PAGE_SIZE)? PAGE_SIZE-(vaddr & PAGE_FRAME) : memsize;
-
-		DEBUG(DB_VM, "firstmemsz : %lu\n", firstmemsz);
-		/* write filesize amount up to vaddr+ firstmemsz, and update the PTE for that vaddr */
-		result = update_ELFPTE( vaddr ,firstmemsz, filesize, offset, __is_executable);
-		if (result){
-			return result;
-		}
-		/* Update filesize, memsize and vaddr. filesize should be zero after update */
-		/* If memsize is within the same page, memsize should be zero after update */
-		filesize -= filesize;
-		memsize -= firstmemsz;
-		vaddr += firstmemsz;
-
-		DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-
-		/* If we still have memsize, aka zeros to fill up */
-		while (memsize > 0){
-			/* filesize = 0 since we have nothing to write anymore */
-			curt_pte = update_ELFPTE( vaddr, (memsize => PAGE_SIZE )? PAGE_SIZE : memsize , 0, offset, __is_executable);
-			if (result){
-				return result;
-			}
-
-			/* Update memsize & vaddr by the (memsize - filesize which is 0) */
-			if (memsize => PAGE_SIZE){
-				memsize = memsize - PAGE_SIZE;
-				vaddr += PAGE_SIZE;
-			}
-			memsize -=memsize;
-			vaddr+= memsize;
-
-			DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-		}
-
+	prot = 0;
+	if (readable) {
+		prot = SET_RDABLE(prot);
+	}
+	if (writeable) {
+		prot = SET_WTABLE(prot);
+	}
+	if (executable) {
+		prot = SET_XTABLE(prot);
 	}
 
- 	/* Multiple PTE needs to be updated with valid filesize */
-	else{
-
-		int i;
-		int pages_required = 0;
-
-		/* first starting page */
-		if((vaddr & PAGE_FRAME) > 0){
-			pages_required ++;
-		}
-
-		/* pages_required + amount of page that has memsize && filesize == PAGE_SIZE */
-		pages_required += (filesize - (PAGE_SIZE- GET_OFFS(vaddr)))/PAGE_SIZE;
-
-		/* Last page */
-		if ((filesize + (vaddr & PAGE_FRAME))% PAGE_SIZE > 0){
-			pages_required ++;
+	for (page = vaddr & PAGE_FRAME; page < top; page += PAGE_SIZE) {
+		spl = splhigh();
+		pte = find_pte(as, page, 1);
+		if (pte == NULL) {
+			splx(spl);
+			return ENOMEM;
 		}
 
-		// Fill up all the PTE up to the last page
-		for ( i = 0; i < pages_required ; i++){
-
-			/* First page */
-			if ( i == 0){
-				size_t firstfz, firstmemsz;
-				firstfsz = PAGE_SIZE - (vaddr & PAGE_FRAME);
-				firstmemsz = firstfsz;
-
-				curt_pte = update_ELFPTE(vaddr, firstmemsz, firstfsz, offset, __is_executable);
-				if(result){
-					return result;
-				}
-				filesize = filesize - firstfsz;
-				memsize = memsize - firstmemsz;
-				offset += firstfsz;
-				vaddr += firstmemsz;
-				DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-			}
-
-			/* Last page */
-			if ( i == (pages_required-1)){
-				if ((filesize + memsize) < PAGE_SIZE){
-					curt_pte = update_ELFPTE( vaddr ,memsize, filesize , offset, __is_executable);
-					if(result){
-						return result;
-					}
-					/* filesize and memsize should all be zero after update, vaddr should be vaddr + memsize */
-					filesize -=filesize;
-					memsize -=memsize;
-					vaddr +=memsize;
-					DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-				}
-
-				/* Fill up zeros when memsize is still > 0 */
-				while(memsize > 0 ){
-					curt_pte = update_ELFPTE( vaddr ,(memsize => PAGE_SIZE )? PAGE_SIZE : memsize , filesize, offset, __is_executable);
-					if (result){
-						return result;
-					}
-					filesize -= filesize;  // after first loop, filesize should be zero after that
-					if (memsize => PAGE_SIZE){
-						memsize = memsize - PAGE_SIZE;
-						vaddr += PAGE_SIZE;
-					}
-					memsize -=memsize;
-					vaddr+= memsize;
-					offset += filesize;
-					DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-				}
-			}
-
-			/* PTE with filesize && memsize == PAGE_SIZE */
-			else{
-				curt_pte = update_ELFPTE(vaddr , PAGE_SIZE, PAGE_SIZE, offset __is_executable);
-				if (result){
-					return result;
-				}
-				filesize = filesize - PAGE_SIZE;
-				memsize = memsize - PAGE_SIZE;
-				offset += PAGE_SIZE;
-				vaddr += PAGE_SIZE;
-				DEBUG(DB_VM, "filesize: %lu, memsize: %lu, vaddr: %lx\n", filesize, memsize, vaddr);
-			}
-		}
+		// A page two segments share gets both protections
+		assert(*pte == 0 || IS_ELF(*pte));
+		*pte = SET_ELF(*pte | prot);
+		splx(spl);
 	}
-}
 
+	return 0;
+}
 
-static
 int
-update_ELFPTE(vaddr_t vaddr, size_t memsize, size_t filesize, off_t offset, int is_executable)
+load_elf_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
 {
-	assert(memsize => 0);
-	assert(filesize => 0);
-	assert(vaddr => 0x0);
-
-	int curt_pte = 0x0;
-	int pdir_index, ptable_index;
+	struct elf_segment *seg;
+	struct uio ku;
+	vaddr_t start, end;
+	int i, result;
 
-	curt_pte = SET_ELF(curt_pte);
-	if( is_executable){
-		curt_pte = SET_E_XBLE(curt_pte);
-	}
+	assert(vaddr % PAGE_SIZE == 0);
+	assert(as->v != NULL);
 
-	curt_pte = SET_FOOFS( curt_pte, offset);
-	curt_pte = SET_FSIZE( curt_pte, filesize);
-	curt_pte = SET_MEMSZ( curt_pte, memsize);
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
 
-	DEBUG(DB_VM, "curt_pte: %lx\n", curt_pte);
+	for (i = 0; i < as->as_nsegs; i++) {
+		seg = &as->as_segs[i];
 
-	pdir_index = GET_PDIR(vaddr);
-	ptable_index = GET_PTBL(vaddr);
+		// The part of this page that the file covers
+		start = seg->es_vaddr;
+		end = seg->es_vaddr + seg->es_filesize;
+		if (start < vaddr) {
+			start = vaddr;
+		}
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (start >= end) {
+			continue;
+		}
 
-	/* If the page table hasnt been created */
-	if (curthread->t_vmspace->page_directory[pdir_index] == NULL){
-		struct page_table *ptable = kmalloc(sizeof(struct page_table));
-		if (ptable == NULL){
-			return 1;
+		mk_kuio(&ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+			end - start, seg->es_offset + (start - seg->es_vaddr),
+			UIO_READ);
+		result = VOP_READ(as->v, &ku);
+		if (result) {
+			return result;
 		}
-		curthread->t_vmspace->page_directory[pdir_index] = ptable;
 
+		if (ku.uio_resid != 0) {
+			/* short read; problem with executable? */
+			kprintf("ELF: short read on segment - file truncated?\n");
+			return ENOEXEC;
+		}
 	}
-	/* The PTE should be first time modified */
-	assert(curthread->t_vmspace->page_directory[pdir_index]->PTE[ptable_index] == 0x0);
-
-	curthread->t_vmspace->page_directory[pdir_index]->PTE[ptable_index] = curt_pte;
 
+	DEBUG(DB_EXEC, "ELF: Loaded page 0x%lx\n", (unsigned long) vaddr);
 	return 0;
 }
 
@@ -284,6 +156,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct addrspace *as = curthread->t_vmspace;
 	int result, i;
 	struct uio ku;
 
@@ -383,44 +256,48 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+	/* The pages are read in from v as they are touched */
+	VOP_INCREF(v);
+	as->v = v;
+
 	/*
-	 * Now actually load each segment.
+	 * Now map each segment. Its pages are read in on demand.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
+		off_t offset = eh.e_phoff + i*eh.e_phentsize;
+		mk_kuio(&ku, &ph, sizeof(ph), offset, UIO_READ);
 
-  		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-  		mk_kuio(&ku, &ph, sizeof(ph), offset, UIO_READ);
-
-  		result = VOP_READ(v, &ku);
-  		if (result) {
-    			return result;
- 		}
-
-  		if (ku.uio_resid != 0) {
-    			/* short read; problem with executable? */
-    			kprintf("ELF: short read on phdr - file truncated?\n");
-    			return ENOEXEC;
-  		}
-
-  		switch (ph.p_type) {
-      			case PT_NULL: /* skip */ continue;
-      			case PT_PHDR: /* skip */ continue;
-      			case PT_MIPS_REGINFO: /* skip */ continue;
-      			case PT_LOAD: break;
-      			default:
-    			kprintf("loadelf: unknown segment type %d\n",
-      			ph.p_type);
-    			return ENOEXEC;
-  		}
-
-
-			result = define_segment_pte(v, ph.p_offset, ph.p_vaddr; ph.p_memsz, ph.p_filesz
-																ph.p_flags & PF_X);
-			if (result){
-				return result;
-			}
+		result = VOP_READ(v, &ku);
+		if (result) {
+			return result;
+		}
 
+		if (ku.uio_resid != 0) {
+			/* short read; problem with executable? */
+			kprintf("ELF: short read on phdr - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		switch (ph.p_type) {
+		    case PT_NULL: /* skip */ continue;
+		    case PT_PHDR: /* skip */ continue;
+		    case PT_MIPS_REGINFO: /* skip */ continue;
+		    case PT_LOAD: break;
+		    default:
+			kprintf("loadelf: unknown segment type %d\n",
+				ph.p_type);
+			return ENOEXEC;
+		}
+
+		result = define_segment(as, ph.p_offset, ph.p_vaddr,
+					ph.p_memsz, ph.p_filesz,
+					ph.p_flags & PF_R,
+					ph.p_flags & PF_W,
+					ph.p_flags & PF_X);
+		if (result) {
+			return result;
+		}
 	}
 
 	result = as_complete_load(curthread->t_vmspace);
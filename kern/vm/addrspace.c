@@ -7,6 +7,8 @@
 #include <curthread.h>
 #include <machine/spl.h>
 #include <machine/tlb.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <kern/types.h>
 
 
@@ -37,27 +39,224 @@ as_create(void)
 	}
 
 
-	as->as_vbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_permission1 = 0x0;
+	/* No page tables until something gets mapped */
+	bzero(as->page_directory, sizeof(as->page_directory));
+	as->v = NULL;
+	as->as_nsegs = 0;
+	as->as_asid = 0;
 
-	as->as_vbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_permission2 = 0x0;
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_rss = 0;
 
-	as->heapvbase = 0;
-	as->heapvtop = 0;
+	return as;
+}
 
-	as->stackvbase = 0;
 
-	return as;
+
+/*
+ * Regions.
+ *
+ * The list is only changed by the process that owns the address space,
+ * but vm_fault reads it with interrupts off, so changes are made with
+ * interrupts off too.
+ */
+struct vm_region *
+as_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next){
+		if (vaddr < vr->vr_start){
+			break;
+		}
+		if (vaddr < VR_END(vr)){
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/* First region that overlaps [start, end), NULL if none */
+static
+struct vm_region *
+region_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next){
+		if (vr->vr_start >= end){
+			break;
+		}
+		if (VR_END(vr) > start && vr->vr_npages > 0){
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/* Link vr into the list in address order */
+static
+void
+region_link(struct addrspace *as, struct vm_region *vr)
+{
+	struct vm_region **link;
+	int spl;
+
+	link = &as->as_regions;
+	while (*link != NULL && (*link)->vr_start <= vr->vr_start){
+		link = &(*link)->vr_next;
+	}
+
+	spl = splhigh();
+	vr->vr_next = *link;
+	*link = vr;
+	splx(spl);
+}
+
+/* Take vr off the list. The caller frees it. */
+static
+void
+region_unlink(struct addrspace *as, struct vm_region *vr)
+{
+	struct vm_region **link;
+	int spl;
+
+	link = &as->as_regions;
+	while (*link != vr){
+		assert(*link != NULL);
+		link = &(*link)->vr_next;
+	}
+
+	spl = splhigh();
+	*link = vr->vr_next;
+	splx(spl);
 }
 
+struct vm_region *
+as_add_region(struct addrspace *as, vaddr_t start, size_t npages,
+	      int prot, int type)
+{
+	struct vm_region *vr;
+	vaddr_t end = start + npages * PAGE_SIZE;
 
+	assert(start % PAGE_SIZE == 0);
 
-// Since we call as_copy in sys_fork rather than md_forkentry, cant use curthread-> pid
-// to pass and set the page. so in sys_fork we pass the new pid in as_copy
-// can be left for now
+	if (end < start || end > USERTOP ||
+	    region_overlap(as, start, end) != NULL){
+		return NULL;
+	}
+
+	vr = kmalloc(sizeof(struct vm_region));
+	if (vr == NULL){
+		return NULL;
+	}
+	vr->vr_start = start;
+	vr->vr_npages = npages;
+	vr->vr_prot = prot;
+	vr->vr_type = type;
+	vr->vr_vnode = NULL;
+	vr->vr_offset = 0;
+
+	region_link(as, vr);
+	return vr;
+}
+
+void
+as_remove_region(struct addrspace *as, struct vm_region *vr)
+{
+	if (as->as_heap == vr){
+		as->as_heap = NULL;
+	}
+	region_unlink(as, vr);
+	if (vr->vr_vnode != NULL){
+		vfs_close(vr->vr_vnode);
+	}
+	kfree(vr);
+}
+
+void
+as_unmap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	int spl, *pte;
+
+	for (va = start; va < end; va += PAGE_SIZE){
+
+		// No page table, nothing in the rest of its range
+		if (as->page_directory[GET_PDIR(va)] == NULL){
+			va = (va & ~(PT_SPAN - 1)) + PT_SPAN - PAGE_SIZE;
+			continue;
+		}
+
+		// Interrupts off so the pager can't swap a page out
+		// between us reading its PTE and freeing it
+		spl = splhigh();
+
+		pte = find_pte(as, va, 0);
+
+		// If the PTE is backed by a physical page, free it on the
+		// coremap; shared copy-on-write pages just lose a reference
+		if (*pte == 0 || IS_ELF(*pte) || IS_ZEROPAGE(*pte)){
+			/* nothing to free */
+		}
+		else if (IS_VALID(*pte)){
+			free_ppage(as, va, GET_PFN(*pte));
+		}
+		// Or by a swap slot
+		else if (IS_SWAPPED(*pte)){
+			swap_free(GET_SWAPSLOT(*pte));
+		}
+
+		*pte = 0;
+		tlb_invalidate(as, va);
+		splx(spl);
+	}
+}
+
+void
+as_droptables(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct page_table *ptable;
+	vaddr_t last = end - PAGE_SIZE;
+	u_int32_t i, j;
+	int spl;
+
+	if (start >= end){
+		return;
+	}
+
+	for (i = GET_PDIR(start); i <= GET_PDIR(last); i++){
+		ptable = as->page_directory[i];
+		if (ptable == NULL){
+			continue;
+		}
+		for (j = 0; j < PTE_MAX; j++){
+			if (ptable->PTE[j] != 0){
+				break;
+			}
+		}
+		if (j < PTE_MAX){
+			continue;
+		}
+
+		// Unhook it before freeing, lookups run with interrupts off
+		spl = splhigh();
+		as->page_directory[i] = NULL;
+		splx(spl);
+		kfree(ptable);
+	}
+}
+
+
+
+/*
+ * Fork-time copy. Resident pages are not copied: the child's PTE points at
+ * the parent's frame, both PTEs are marked copy-on-write and the frame's
+ * refcount is bumped. The first write from either side splits the page in
+ * vm_fault, so the cost of fork scales with the pages actually written.
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -65,136 +264,146 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 
 
 	struct addrspace *new;
+	int spl;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	/* Copy the data & code segment info */
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_permission2 = old->as_permission2;
-
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-	new->as_permission2 = old->as_permission2;
+	/* ELF pages not read in yet are loaded from the same file */
+	if (old->v != NULL){
+		VOP_INCREF(old->v);
+		new->v = old->v;
+	}
+	new->as_nsegs = old->as_nsegs;
+	memmove(new->as_segs, old->as_segs, sizeof(old->as_segs));
+
+	/* Same regions */
+	struct vm_region *vr, *nvr;
+
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next){
+		nvr = as_add_region(new, vr->vr_start, vr->vr_npages,
+				    vr->vr_prot, vr->vr_type);
+		if (nvr == NULL){
+			as_destroy(new);
+			return ENOMEM;
+		}
+		if (vr == old->as_heap){
+			new->as_heap = nvr;
+			new->as_heapbrk = old->as_heapbrk;
+		}
+		// The child gets the mapped file open as well
+		if (vr->vr_vnode != NULL){
+			VOP_INCOPEN(vr->vr_vnode);
+			VOP_INCREF(vr->vr_vnode);
+			nvr->vr_vnode = vr->vr_vnode;
+			nvr->vr_offset = vr->vr_offset;
+		}
+	}
 
-	/* Copy stack & heap addresses */
-	new->heapvbase = old->heapvbase;
-	new->heapvtop = old->heapvtop;
-	new->stackvbase = old->stackvbase;
+	/* Copy the PTEs of every mapped page */
+	vaddr_t va;
+	int *pte;
 
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next){
+		for (va = vr->vr_start; va < VR_END(vr); va += PAGE_SIZE){
 
-	/* Copy everything in old as's page directory & table */
-	u_int32_t i, j;
+			// No page table, nothing in the rest of its range
+			if (old->page_directory[GET_PDIR(va)] == NULL){
+				va = (va & ~(PT_SPAN - 1)) + PT_SPAN - PAGE_SIZE;
+				continue;
+			}
 
-	// Loop through page directory, if ptr isnt null, kmalloc a page table for new
-	for (i = 0 ; i < PDE_MAX ; i++){
-
-		// If the old page directory pointer points to a page table
-		if (old-> page_directory[i] != NULL){
-
-			// allocate a page table for new page directory
-			struct page_table *ptable = kmalloc(sizeof(struct page_table));
-			assert(ptable != NULL);
-			new->page_directory[i]= ptable;
-
-			// Loop through old ptable, if a pte exists, allocate a page for new as
-			// and copy everything from old page -> new page
-			for (j = 0 ; j < PTE_MAX; j++){
-
-				if (old-> page_directory[i]-> PTE[j] != 0){
-
-					/*
-					 *  1. first allocate a user page
-					 *  2. find out the PFN of the page & copy other bits
-					 *     to form a PTE for new as. Insert in its ptable
-					 *  3. in order to move the old page content to new,
-					 *     find out the oldpage's & newpage's pa, convert
-					 *     to kvaddr in order to use memmove
-					 */
-					// TODO: what about the old's pages not in phy memory?
-					int new_PTE, new_PFN;
-					vaddr_t new_va, old_va;
-					paddr_t new_pa, old_pa;
-
-					// Find the vaddr for this PTE
-					// & allocate a page for new
-					new_va = vaddr_join(i , j);
-					new_pa = get_ppage(new_va);
-					assert(new_pa != 0 );
-
-					// Update the page table entry in new
-					new_PTE = old->page_directory[i]->PTE[j];
-					new_PTE = new_PTE & 0xFFFFFC00; // mask the PFN in old
-					new_PFN = new_pa / PAGE_SIZE; // find the PFN for new
-					new_PTE = new_PTE | new_PFN;  // create the new PTE
-					new->page_directory[i]->PTE[j] = new_PTE; // insert
-
-					// Find the paddr of the old's page
-					old_pa = (old->page_directory[i]->PTE[j]) & PFN_MASK;
-					old_pa = old_pa * PAGE_SIZE;
-
-					// Convert them to kernel vaddr to use memmove
-					// for new_va, we already set the PTE, now need to 						// convert to kernel vaddr for memmove
-					new_va = PADDR_TO_KVADDR(new_pa);
-					old_va = PADDR_TO_KVADDR(old_pa);
-
-					memmove((void*)new_va, (const void*)old_va, PAGE_SIZE);
+			int old_PTE = *find_pte(old, va, 0);
+			if (old_PTE == 0){
+				continue;
+			}
 
-				}
-				// If no PTE exists, then set new's PTE = 0x0
-				else{
-					new->page_directory[i]->PTE[j] = 0;
+			// Interrupts off so the fault handler can't split a
+			// page while we are sharing it. Making the child's
+			// page table may sleep, so the PTE is read again
+			// afterwards.
+			spl = splhigh();
+			pte = find_pte(new, va, 1);
+			if (pte == NULL){
+				splx(spl);
+				as_destroy(new);
+				return ENOMEM;
+			}
+			old_PTE = *find_pte(old, va, 0);
+
+			/*
+			 * Resident page: share the frame. Writable pages are
+			 * marked COW in both the parent and the child.
+			 * Anything else (ELF, untouched heap) is just copied.
+			 */
+			if (old_PTE != 0 && !IS_ELF(old_PTE) && IS_VALID(old_PTE)
+			    && !IS_ZEROPAGE(old_PTE)){
+				share_ppage(new, GET_PFN(old_PTE));
+				if (IS_WTABLE(old_PTE)){
+					old_PTE = SET_COW(old_PTE);
+					*find_pte(old, va, 0) = old_PTE;
 				}
 			}
-		}
-		// If no page table exists, set the new page directory pointer to NULL
-		else{
-			new->page_directory[i] = NULL;
-		}
+			// Swapped-out page: both now refer to the same slot
+			else if (old_PTE != 0 && !IS_ELF(old_PTE) && IS_SWAPPED(old_PTE)){
+				swap_share(GET_SWAPSLOT(old_PTE));
+			}
+			*pte = old_PTE;
 
+			splx(spl);
+		}
 	}
 
+	/*
+	 * The parent may still have writable TLB entries for the pages we
+	 * just made copy-on-write, so throw them away.
+	 */
+	spl = splhigh();
+	tlb_flushas(old);
+	splx(spl);
+
 	*ret = new;
 	return 0;
 }
 
 
 
-// TODO: need to change for swapping
 void
 as_destroy(struct addrspace *as)
 {
-	u_int32_t i, j;
-
-	// Loop through the page directory
-	for ( i=0; i < PDE_MAX ; i++){
+	struct vm_region *vr;
+	u_int32_t i;
+	int spl;
 
-		// If there exists a page table
-		if ( as->page_directory[i] != NULL){
-			// Loop through that page table
-			for ( j = 0 ; j < PTE_MAX; j++){
-
-				// If the PTE exists
-				if(as->page_directory[i]->PTE[j] != 0){
+	// The UTLB refill handler must not walk tables we are freeing.
+	// Dropping the ASID retires our TLB entries all at once, so
+	// as_unmap doesn't have to hunt them down.
+	spl = splhigh();
+	if (curpgdir == as->page_directory){
+		curpgdir = NULL;
+	}
+	as->as_asid = 0;
+	splx(spl);
 
-					// get the vaddr of that PTE
-					vaddr_t vaddr = vaddr_join(i,j);
-					// get the PFN in that PTE
-					u_int32_t pfn = (as->page_directory[i]->PTE[j]) & PFN_MASK;
+	// Give back the pages of every region
+	while ((vr = as->as_regions) != NULL){
+		as_unmap(as, vr->vr_start, VR_END(vr));
+		as_remove_region(as, vr);
+	}
 
-					// free the pages on the coremap
-					// TODO: what if that vaddr is not mapped to any ppage?
-					free_ppage(vaddr, pfn);
-				}
-			}
-			// Free the page table after freeing PTE
+	// Free the page tables after freeing the PTEs
+	for (i = 0; i < PDE_MAX; i++){
+		if (as->page_directory[i] != NULL){
 			kfree(as->page_directory[i]);
 		}
 	}
 
+	if (as->v != NULL){
+		VOP_DECREF(as->v);
+	}
+
 	kfree(as);
 }
 
@@ -203,16 +412,11 @@ as_destroy(struct addrspace *as)
 void
 as_activate(struct addrspace *as)
 {
-	int i, spl;
-
-	(void)as;
+	int spl;
 
+	// No flush, the TLB entries are tagged with the ASID
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
+	asid_activate(as);
 	splx(spl);
 }
 
@@ -224,9 +428,8 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They
+ * become the protection of the VR_ELF region made for it.
  */
 
 
@@ -234,7 +437,9 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	size_t npages;
+	struct vm_region *vr;
+	vaddr_t end;
+	int prot;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -243,58 +448,54 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	/* Number of pages we need to allocate for this region */
-	npages = sz / PAGE_SIZE;
-
-
-	/* Set up address space either code / data depending on permission */
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		as->as_permission1 = readable | writeable | executable;
-
-		// make sure addr is page aligned
-		assert(as->as_vbase1 % PAGE_SIZE == 0);
+	end = vaddr + sz;
+	if (end < vaddr || end > USERTOP){
+		return EFAULT;
 	}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		as->as_permission2 = readable | writeable | executable;
-
-		// make sure addr is page aligned
-		assert(as->as_vbase2 % PAGE_SIZE == 0);
+	prot = 0;
+	if (readable){
+		prot = SET_RDABLE(prot);
+	}
+	if (writeable){
+		prot = SET_WTABLE(prot);
+	}
+	if (executable){
+		prot = SET_XTABLE(prot);
 	}
 
-	/* Set up heap only after data and code region is set up */
-	if (as->heapvbase == 0 && as->as_vbase1 != 0 && as->as_vbase2 != 0 ){
-
-		vaddr_t data_base;
-		size_t data_npages;
-
-		/* Decide which region 1/2 has higher address */
-		if ( as->as_vbase1 > as->as_vbase2 ){
-			data_base = as->as_vbase1;
-			data_npages = as->as_npages1;
+	/* A page two segments share ends up in one region with both protections */
+	while ((vr = region_overlap(as, vaddr, end)) != NULL){
+		if (vr->vr_type != VR_ELF){
+			return EINVAL;
 		}
-		else{
-			data_base = as->as_vbase2;
-			data_npages = as->as_npages2;
+		if (vr->vr_start < vaddr){
+			vaddr = vr->vr_start;
 		}
+		if (VR_END(vr) > end){
+			end = VR_END(vr);
+		}
+		prot |= vr->vr_prot;
 
-		/* heap should start right after data segment end */
-		as->heapvbase = (data_npages * PAGE_SIZE) + data_base;	
-		as->heapvtop = as->heapvbase;
+		region_unlink(as, vr);
+		kfree(vr);
+	}
 
-		/* Make sure heap is page aligned */
-		assert(as->heapvbase % PAGE_SIZE == 0);
-		// TODO: should we make sure that it is larger or equal to end of data seg?
+	if (as_add_region(as, vaddr, (end - vaddr) / PAGE_SIZE, prot,
+			  VR_ELF) == NULL){
+		return ENOMEM;
 	}
+	return 0;
+}
 
+// Nothing to prepare, pages are loaded on demand
+int
+as_prepare_load(struct addrspace *as)
+{
+	(void)as;
 	return 0;
 }
 
-// We dont really need this since we implement demand paging
 /*
 int
 as_prepare_load(struct addrspace *as)
@@ -322,11 +523,28 @@ as_prepare_load(struct addrspace *as)
 }
 */
 
-// dont really need this since we implement demand paging
+/*
+ * Pages are loaded on demand, so all that is left is the heap. It starts
+ * out empty, right after the highest segment, and sbrk grows it.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	struct vm_region *vr;
+	vaddr_t top = 0;
+
+	assert(as->as_heap == NULL);
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next){
+		top = VR_END(vr);
+	}
+
+	as->as_heap = as_add_region(as, top, 0,
+				    SET_RDABLE(SET_WTABLE(0)), VR_HEAP);
+	if (as->as_heap == NULL){
+		return ENOMEM;
+	}
+	as->as_heapbrk = top;
 	return 0;
 }
 
@@ -336,15 +554,12 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	assert(as->stackvbase != 0);
-
-	/* Max stack page is 256, but we can only allocate one page space for now */
-	as->stackvbase = USERSTACK - PAGE_SIZE;
-	as->stackvbase &= PAGE_SIZE;
-
-	/* Make sure stack base is page aligned */
-	assert(as->stackvbase % PAGE_SIZE == 0);
-
+	/* Stack pages are allocated on first touch, up to STACK_MAXPAGE */
+	if (as_add_region(as, USERSTACK - STACK_MAXPAGE * PAGE_SIZE,
+			  STACK_MAXPAGE, SET_RDABLE(SET_WTABLE(0)),
+			  VR_STACK) == NULL){
+		return ENOMEM;
+	}
 
 	/* User stack pointer */
 	*stackptr = USERSTACK;
@@ -352,27 +567,24 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 
-int
-as_get_permission(struct addrspace *as, vaddr_t vaddr){
+int *
+find_pte(struct addrspace *as, vaddr_t vaddr, int create){
 
-	vaddr_t region1top = as->as_vbase1 + (as->as_npages1*PAGE_SIZE);
-	vaddr_t region2top = as->as_vbase2 + (as->as_npages2*PAGE_SIZE);
+	u_int32_t pdir_index = GET_PDIR(vaddr);
+	u_int32_t ptable_index = GET_PTBL(vaddr);
 
-	// If vaddr in region 1, return region 1 permission
-	if ( vaddr < region1top && vaddr >= as->as_vbase1){
-		return as->as_permission1;
-	}
+	/* If the page table hasnt been created */
+	if (as->page_directory[pdir_index] == NULL){
+		if (!create){
+			return NULL;
+		}
 
-	// else region 2 permission
-	else if (vaddr < region2top && vaddr >= as->as_vbase2){
-		return as->as_permission2;
+		struct page_table *ptable = kzalloc(sizeof(struct page_table));
+		if (ptable == NULL){
+			return NULL;
+		}
+		as->page_directory[pdir_index] = ptable;
 	}
 
-	// must be heap or stack (R/W) (0b110)
-	else
-		return 0x6;
+	return &as->page_directory[pdir_index]->PTE[ptable_index];
 }
-
-
-int *
-find_pte (pdir_index,
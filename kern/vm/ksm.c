@@ -0,0 +1,263 @@
+/*
+ * Same-page merging.
+ *
+ * Processes running the same program, forked or not, often end up with
+ * private pages that hold exactly the same bytes at the same address.
+ * When turned on (menu command "ksm"), a kernel thread walks the
+ * coremap a batch of frames every second, hashes each user page, and
+ * looks for an earlier page with the same hash at the same vaddr. If
+ * the two really are identical, the second one is mapped onto the
+ * first frame read-only and its own frame is freed. A write to either
+ * page later goes through the usual copy-on-write split in vm_fault.
+ *
+ * Only pages at the same vaddr are merged: everything else in the VM
+ * assumes that all PTEs mapping a frame sit at the frame's vaddr, just
+ * like after a fork.
+ *
+ * The hash table is rebuilt on every pass over the coremap, and a match
+ * is always checked byte by byte, so stale entries do no harm. A page
+ * that has a copy in swap or belongs to the page cache is left alone.
+ *
+ * The scanning runs with interrupts off, so no user code can write to
+ * a page between comparing and merging it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <machine/spl.h>
+
+#define KSM_NBUCKETS 256
+#define KSM_BATCH 256       // frames looked at per second
+
+static int ksm_on;
+static int ksm_hand;                  // next coremap index to look at
+static int ksm_buckets[KSM_NBUCKETS]; // first entry, -1 if none
+
+/* Per coremap index */
+static u_int32_t *ksm_sum;   // hash of the page when it went in the table
+static int *ksm_next;        // next entry in the same bucket, -1 if none
+
+/* Counters */
+static u_int32_t ksm_scanned;   // frames looked at
+static u_int32_t ksm_merged;    // pages mapped onto another frame
+static u_int32_t ksm_passes;    // full passes over the coremap
+
+/* Start a new pass with an empty table */
+static
+void
+ksm_reset(void)
+{
+	int i;
+
+	for (i = 0; i < KSM_NBUCKETS; i++){
+		ksm_buckets[i] = -1;
+	}
+}
+
+static
+u_int32_t
+ksm_hash(int index)
+{
+	const u_int32_t *p = (const u_int32_t *)
+		PADDR_TO_KVADDR(coremap[index].paddr);
+	u_int32_t sum;
+	int i;
+
+	sum = coremap[index].vaddr;
+	for (i = 0; i < PAGE_SIZE / 4; i++){
+		sum = (sum << 5) + sum + p[i];
+	}
+	return sum;
+}
+
+/* Nonzero if the frames at a and b hold the same bytes */
+static
+int
+ksm_same(int a, int b)
+{
+	const u_int32_t *pa = (const u_int32_t *)
+		PADDR_TO_KVADDR(coremap[a].paddr);
+	const u_int32_t *pb = (const u_int32_t *)
+		PADDR_TO_KVADDR(coremap[b].paddr);
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / 4; i++){
+		if (pa[i] != pb[i]){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Nonzero if the user page at index is one we may merge at all */
+static
+int
+ksm_mergeable(int index)
+{
+	struct coremap_entry *cme = &coremap[index];
+
+	if (cme->pstate != PDIRTY && cme->pstate != PCLEAN){
+		return 0;
+	}
+	return cme->pc_vnode == NULL && cme->swapslot == -1 &&
+		cme->refcount > 0;
+}
+
+/*
+ * Map the page at index onto the identical frame at target and free
+ * its own frame. pte is the one PTE mapping the page.
+ */
+static
+void
+ksm_merge(int index, int *pte, int target)
+{
+	struct coremap_entry *cme = &coremap[index];
+	struct coremap_entry *tcme = &coremap[target];
+	struct addrspace *as = cme->as;
+	vaddr_t vaddr = cme->vaddr;
+	int *tpte;
+
+	// The first sharer has to go read-only too
+	if (tcme->refcount == 1){
+		tpte = coremap_evictable(target);
+		assert(tpte != NULL);
+		if (IS_WTABLE(*tpte)){
+			*tpte = SET_COW(*tpte);
+		}
+		tlb_invalidate(tcme->as, vaddr);
+	}
+
+	// Nobody knows any more whether every sharer still matches the
+	// executable, so this has to go to swap if it is ever evicted
+	tcme->pstate = PDIRTY;
+
+	share_ppage(as, tcme->paddr / PAGE_SIZE);
+	*pte = SET_PFN(*pte, tcme->paddr / PAGE_SIZE);
+	if (IS_WTABLE(*pte)){
+		*pte = SET_COW(*pte);
+	}
+	tlb_invalidate(as, vaddr);
+
+	free_ppage(as, vaddr, cme->paddr / PAGE_SIZE);
+	ksm_merged++;
+}
+
+/* Look at the frame under the hand and move the hand on */
+static
+void
+ksm_scan(void)
+{
+	u_int32_t sum;
+	int index, bucket, other, spl;
+	int *pte;
+
+	spl = splhigh();
+
+	index = ksm_hand;
+	ksm_hand = (ksm_hand + 1) % coremap_size;
+	if (ksm_hand == 0){
+		ksm_reset();
+		ksm_passes++;
+	}
+
+	// Only pages with exactly one known mapping get merged away
+	pte = coremap_evictable(index);
+	if (pte == NULL || !ksm_mergeable(index)){
+		splx(spl);
+		return;
+	}
+	ksm_scanned++;
+
+	sum = ksm_hash(index);
+	bucket = sum % KSM_NBUCKETS;
+
+	for (other = ksm_buckets[bucket]; other != -1;
+	     other = ksm_next[other]){
+		if (other == index || ksm_sum[other] != sum ||
+		    !ksm_mergeable(other) ||
+		    coremap[other].vaddr != coremap[index].vaddr){
+			continue;
+		}
+		// A lone page must still be where its PTE says
+		if (coremap[other].refcount == 1 &&
+		    coremap_evictable(other) == NULL){
+			continue;
+		}
+		if (ksm_same(other, index)){
+			ksm_merge(index, pte, other);
+			splx(spl);
+			return;
+		}
+	}
+
+	ksm_sum[index] = sum;
+	ksm_next[index] = ksm_buckets[bucket];
+	ksm_buckets[bucket] = index;
+	splx(spl);
+}
+
+static
+void
+ksm_thread(void *unused1, unsigned long unused2)
+{
+	int i, spl;
+
+	(void)unused1;
+	(void)unused2;
+
+	for (;;){
+		spl = splhigh();
+		while (!ksm_on){
+			thread_sleep(&ksm_on);
+		}
+		splx(spl);
+
+		for (i = 0; i < KSM_BATCH; i++){
+			ksm_scan();
+		}
+		clocksleep(1);
+	}
+}
+
+/* Set up the table and start the scanner, which waits to be turned on */
+void
+ksm_bootstrap(void)
+{
+	int result;
+
+	ksm_sum = kmalloc(coremap_size * sizeof(u_int32_t));
+	ksm_next = kmalloc(coremap_size * sizeof(int));
+	if (ksm_sum == NULL || ksm_next == NULL){
+		panic("ksm: Out of memory\n");
+	}
+	ksm_reset();
+
+	result = thread_fork("ksm", NULL, 0, ksm_thread, NULL);
+	if (result){
+		panic("ksm: Could not start the scanner: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+ksm_setenabled(int on)
+{
+	int spl;
+
+	spl = splhigh();
+	ksm_on = on;
+	if (on){
+		thread_wakeup(&ksm_on);
+	}
+	splx(spl);
+}
+
+void
+ksm_printstats(void)
+{
+	kprintf("ksm: %s, %u pages scanned, %u merged, %u passes\n",
+		ksm_on ? "on" : "off", ksm_scanned, ksm_merged, ksm_passes);
+}
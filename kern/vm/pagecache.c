@@ -0,0 +1,271 @@
+/*
+ * Page cache for read-only pages of executables.
+ *
+ * Every process running the same program sees the same image at the
+ * same addresses, so a read-only page of it can be shared by all of
+ * them. Pages are looked up by (vnode, vaddr) rather than file offset:
+ * that way pages holding the end of one segment and the start of the
+ * next, or a zero-filled tail, are covered too.
+ *
+ * A cached frame is an ordinary user frame (refcount = # of PTEs mapping
+ * it) with pc_vnode set. When the last PTE goes away free_ppage parks it
+ * as PCACHED instead of freeing it, so the next exec of the program finds
+ * it without reading the disk. PCACHED frames are the first thing
+ * get_ppage takes back when memory runs out.
+ *
+ * Each cached frame holds a reference to its vnode, so the vnode can't
+ * be recycled for another file while we still have pages of it.
+ *
+ * Nothing notices a write to the file itself, so a rebuilt program
+ * would still run the old text. Instead vfs_open drops every page of a
+ * vnode that is opened for writing (pagecache_invalidate): unmapped
+ * ones are freed, mapped ones stay with their processes as ordinary
+ * pages. A process that already runs the file keeps what it has and
+ * reads the rest in from the new contents, as without the cache.
+ *
+ * Lookups run with interrupts off.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <machine/spl.h>
+
+#define PC_NBUCKETS 64
+
+static int pc_buckets[PC_NBUCKETS];   // coremap index of first page, -1 if none
+static int pc_hand;                   // where pagecache_reclaim looks next
+
+/* Counters */
+static u_int32_t pc_hits;
+static u_int32_t pc_misses;
+static u_int32_t pc_pages;      // frames in the cache
+static u_int32_t pc_unmapped;   // ... that nobody maps (PCACHED)
+
+static
+int
+pc_hash(struct vnode *v, vaddr_t vaddr)
+{
+	return (((u_int32_t)v >> 4) ^ (vaddr / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+void
+pagecache_bootstrap(void)
+{
+	int i;
+
+	for (i = 0; i < PC_NBUCKETS; i++){
+		pc_buckets[i] = -1;
+	}
+}
+
+/* Coremap index of the cached copy of (v, vaddr), -1 if none */
+static
+int
+pc_find(struct vnode *v, vaddr_t vaddr)
+{
+	int index;
+
+	index = pc_buckets[pc_hash(v, vaddr)];
+	while (index != -1){
+		if (coremap[index].pc_vnode == v && coremap[index].vaddr == vaddr){
+			return index;
+		}
+		index = coremap[index].pc_next;
+	}
+	return -1;
+}
+
+/* Take a reference to the cached frame at index for as */
+static
+paddr_t
+pc_get(int index, struct addrspace *as)
+{
+	struct coremap_entry *cme = &coremap[index];
+
+	if (cme->pstate == PCACHED){
+		cme->pstate = PCLEAN;
+		cme->refcount = 1;
+		cme->as = as;
+		pc_unmapped--;
+	}
+	else{
+		cme->refcount++;
+	}
+	as->as_rss++;
+	return cme->paddr;
+}
+
+paddr_t
+pagecache_lookup(struct vnode *v, vaddr_t vaddr, struct addrspace *as)
+{
+	int index;
+
+	index = pc_find(v, vaddr);
+	if (index == -1){
+		pc_misses++;
+		return 0;
+	}
+
+	pc_hits++;
+	return pc_get(index, as);
+}
+
+paddr_t
+pagecache_insert(struct vnode *v, vaddr_t vaddr, paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	int index, bucket;
+
+	// Somebody else read the same page in while we were at it
+	index = pc_find(v, vaddr);
+	if (index != -1){
+		return pc_get(index, coremap[PADDR_TO_CMINDEX(paddr)].as);
+	}
+
+	index = PADDR_TO_CMINDEX(paddr);
+	cme = &coremap[index];
+	assert(cme->pc_vnode == NULL);
+	assert(cme->vaddr == vaddr);
+
+	VOP_INCREF(v);
+	cme->pc_vnode = v;
+
+	bucket = pc_hash(v, vaddr);
+	cme->pc_next = pc_buckets[bucket];
+	pc_buckets[bucket] = index;
+	pc_pages++;
+
+	return paddr;
+}
+
+void
+pagecache_release(int index)
+{
+	struct coremap_entry *cme = &coremap[index];
+
+	assert(cme->pc_vnode != NULL);
+	assert(cme->refcount == 0);
+
+	cme->pstate = PCACHED;
+	cme->as = NULL;
+	pc_unmapped++;
+}
+
+void
+pagecache_remove(int index)
+{
+	struct coremap_entry *cme = &coremap[index];
+	struct vnode *v = cme->pc_vnode;
+	int *link;
+
+	if (v == NULL){
+		return;
+	}
+
+	link = &pc_buckets[pc_hash(v, cme->vaddr)];
+	while (*link != index){
+		assert(*link != -1);
+		link = &coremap[*link].pc_next;
+	}
+	*link = cme->pc_next;
+
+	cme->pc_vnode = NULL;
+	cme->pc_next = -1;
+	pc_pages--;
+	if (cme->pstate == PCACHED){
+		pc_unmapped--;
+	}
+
+	// May sleep if this was the last reference
+	VOP_DECREF(v);
+}
+
+int
+pagecache_reclaim(void)
+{
+	int i, index;
+
+	// Dropping the vnode reference may need to sleep
+	if (pc_unmapped == 0 || in_interrupt){
+		return -1;
+	}
+
+	for (i = 0; i < coremap_size; i++){
+		index = pc_hand;
+		pc_hand = (pc_hand + 1) % coremap_size;
+
+		if (coremap[index].pstate == PCACHED){
+			// Ours now, nobody else may pick it while we sleep
+			coremap[index].pstate = PKERNEL;
+			pc_unmapped--;
+			pagecache_remove(index);
+			return index;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Coremap index of a cached page of v that is unmapped (PCACHED) if
+ * unmapped is set, mapped otherwise. -1 if none.
+ */
+static
+int
+pc_findvnode(struct vnode *v, int unmapped)
+{
+	int i, index;
+
+	for (i = 0; i < PC_NBUCKETS; i++){
+		for (index = pc_buckets[i]; index != -1;
+		     index = coremap[index].pc_next){
+			if (coremap[index].pc_vnode == v &&
+			    (coremap[index].pstate == PCACHED) == unmapped){
+				return index;
+			}
+		}
+	}
+	return -1;
+}
+
+int
+pagecache_reclaimvnode(struct vnode *v)
+{
+	int index;
+
+	// Dropping the vnode reference may need to sleep
+	if (in_interrupt){
+		return -1;
+	}
+
+	index = pc_findvnode(v, 1);
+	if (index != -1){
+		// Ours now, as in pagecache_reclaim
+		coremap[index].pstate = PKERNEL;
+		pc_unmapped--;
+		pagecache_remove(index);
+	}
+	return index;
+}
+
+void
+pagecache_detach(struct vnode *v)
+{
+	int index;
+
+	// Start over each time, pagecache_remove may sleep. Unmapped
+	// pages are left to pagecache_reclaimvnode, which frees them.
+	while ((index = pc_findvnode(v, 0)) != -1){
+		pagecache_remove(index);
+	}
+}
+
+void
+pagecache_printstats(void)
+{
+	kprintf("pagecache: %u pages (%u unmapped), %u hits, %u misses\n",
+		pc_pages, pc_unmapped, pc_hits, pc_misses);
+}
@@ -0,0 +1,212 @@
+/*
+ * Page replacement policies.
+ *
+ * When memory runs low pageout (vm.c) asks the current policy which frame
+ * to push out to swap. Policies only ever look at frames that
+ * coremap_evictable accepts.
+ *
+ *   fifo   - evict the page that was brought in longest ago
+ *   clock  - second chance: the hand clears the ref bit of referenced
+ *            pages and takes the first page that is not referenced
+ *   eclock - enhanced clock: like clock, but looks for a page that is
+ *            both unreferenced and clean first, since that one can be
+ *            dropped without writing it to disk
+ *
+ * vm_fault sets the PTE ref bit every time it loads a translation. When
+ * the hand clears the bit it also throws the TLB entry out, so the next
+ * access to the page faults and sets the bit again.
+ *
+ * All of this runs with interrupts off.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <machine/spl.h>
+
+static int fifo_victim(void);
+static int clock_victim(void);
+static int eclock_victim(void);
+
+static const struct policy {
+	const char *name;
+	int (*victim)(void);
+} policies[] = {
+	{ "fifo",	fifo_victim },
+	{ "clock",	clock_victim },
+	{ "eclock",	eclock_victim },
+	{ NULL, NULL }
+};
+
+static const struct policy *curpolicy = &policies[2];
+
+static int hand;             // clock hand, a coremap index
+static u_int32_t loadclock;  // bumped every time a page comes in
+
+/* Counters, reset when the policy is changed */
+static u_int32_t n_victims;   // pages picked for eviction
+static u_int32_t n_clean;     // ... that were clean
+static u_int32_t n_scanned;   // frames looked at to find them
+static u_int32_t n_second;    // referenced pages passed over
+
+void
+replace_loaded(int index)
+{
+	coremap[index].loadtime = ++loadclock;
+}
+
+/*
+ * Nonzero if the page can go without a disk write: it has an up to date
+ * copy in swap, or is an untouched page of the executable.
+ */
+static
+int
+is_clean(int index)
+{
+	return coremap[index].pstate == PCLEAN;
+}
+
+/*
+ * Give a referenced page a second chance: clear its ref bit and drop it
+ * from the TLB so that we notice the next access.
+ * Returns nonzero if the page was referenced.
+ */
+static
+int
+second_chance(int index, int *pte)
+{
+	if (!IS_REF(*pte)){
+		return 0;
+	}
+	*pte = CLR_REF(*pte);
+	tlb_invalidate(coremap[index].as, coremap[index].vaddr);
+	n_second++;
+	return 1;
+}
+
+/* Return the frame under the hand and move the hand on */
+static
+int
+clock_advance(void)
+{
+	int index = hand;
+
+	hand = (hand + 1) % coremap_size;
+	n_scanned++;
+	return index;
+}
+
+static
+int
+fifo_victim(void)
+{
+	int i, victim = -1;
+
+	for (i = 0; i < coremap_size; i++){
+		if (coremap_evictable(i) == NULL){
+			continue;
+		}
+		// signed difference so the clock may wrap
+		if (victim == -1 || (int)(coremap[i].loadtime -
+					  coremap[victim].loadtime) < 0){
+			victim = i;
+		}
+	}
+	n_scanned += coremap_size;
+	return victim;
+}
+
+static
+int
+clock_victim(void)
+{
+	int i, index;
+	int *pte;
+
+	// After one full turn every ref bit is clear
+	for (i = 0; i < 2 * coremap_size; i++){
+		index = clock_advance();
+		pte = coremap_evictable(index);
+		if (pte == NULL || second_chance(index, pte)){
+			continue;
+		}
+		return index;
+	}
+	return -1;
+}
+
+static
+int
+eclock_victim(void)
+{
+	int round, i, index;
+	int *pte;
+
+	for (round = 0; round < 2; round++){
+		// Unreferenced and clean: free to drop, leave ref bits alone
+		for (i = 0; i < coremap_size; i++){
+			index = clock_advance();
+			pte = coremap_evictable(index);
+			if (pte != NULL && !IS_REF(*pte) && is_clean(index)){
+				return index;
+			}
+		}
+
+		// Unreferenced and dirty, clearing ref bits on the way so
+		// the next round is sure to find something
+		for (i = 0; i < coremap_size; i++){
+			index = clock_advance();
+			pte = coremap_evictable(index);
+			if (pte == NULL || second_chance(index, pte)){
+				continue;
+			}
+			return index;
+		}
+	}
+	return -1;
+}
+
+int
+replace_victim(void)
+{
+	int index;
+
+	if (coremap_size == 0){
+		return -1;
+	}
+
+	index = curpolicy->victim();
+	if (index >= 0){
+		n_victims++;
+		if (is_clean(index)){
+			n_clean++;
+		}
+	}
+	return index;
+}
+
+int
+replace_setpolicy(const char *name)
+{
+	int i, spl;
+
+	for (i = 0; policies[i].name != NULL; i++){
+		if (!strcmp(name, policies[i].name)){
+			spl = splhigh();
+			curpolicy = &policies[i];
+			n_victims = n_clean = n_scanned = n_second = 0;
+			splx(spl);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+replace_printstats(void)
+{
+	kprintf("replace: %s, %u victims (%u clean), %u frames scanned, "
+		"%u second chances\n", curpolicy->name, n_victims, n_clean,
+		n_scanned, n_second);
+}
@@ -0,0 +1,78 @@
+/*
+ * Shrinker registry.
+ *
+ * Kernel caches that hold memory they could do without (the zero pool,
+ * the page cache, the compressed swap pool) register a shrinker here.
+ * When get_ppage or alloc_kpages runs out of frames it calls
+ * shrink_caches before it gives up, so those caches can grow as big as
+ * free memory allows and shrink again when someone needs the pages.
+ *
+ * Shrinkers are called in the order they were registered, so the
+ * cheapest ones should go first. They are never unregistered, which
+ * lets shrink_caches walk the list while a shrinker sleeps.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+static struct shrinker *shrinkers;   // in registration order
+
+void
+shrinker_register(struct shrinker *sh, const char *name,
+		  int (*shrink)(int npages))
+{
+	struct shrinker **link;
+	int spl;
+
+	assert(shrink != NULL);
+
+	sh->sh_name = name;
+	sh->sh_shrink = shrink;
+	sh->sh_calls = 0;
+	sh->sh_freed = 0;
+	sh->sh_next = NULL;
+
+	spl = splhigh();
+	for (link = &shrinkers; *link != NULL; link = &(*link)->sh_next){
+		assert(*link != sh);
+	}
+	*link = sh;
+	splx(spl);
+}
+
+int
+shrink_caches(int npages)
+{
+	struct shrinker *sh;
+	int freed, n;
+
+	assert(npages > 0);
+
+	freed = 0;
+	for (sh = shrinkers; sh != NULL && freed < npages; sh = sh->sh_next){
+		n = sh->sh_shrink(npages - freed);
+		sh->sh_calls++;
+		sh->sh_freed += n;
+		freed += n;
+
+		if (n > 0){
+			DEBUG(DB_VM, "shrink: %s gave back %d pages\n",
+			      sh->sh_name, n);
+		}
+	}
+	return freed;
+}
+
+void
+shrink_printstats(void)
+{
+	struct shrinker *sh;
+
+	kprintf("shrink:");
+	for (sh = shrinkers; sh != NULL; sh = sh->sh_next){
+		kprintf(" %s %u/%u%s", sh->sh_name, sh->sh_freed, sh->sh_calls,
+			sh->sh_next != NULL ? "," : "");
+	}
+	kprintf(" (pages freed/calls)\n");
+}
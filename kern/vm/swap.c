@@ -0,0 +1,293 @@
+/*
+ * Swap space.
+ *
+ * User pages are paged out to a raw disk (SWAP_DEVICE), one page per
+ * swap slot. Free slots are tracked with a bitmap. Since fork shares
+ * swapped-out pages between parent and child, every slot also has a
+ * reference count and is only released once nobody points at it.
+ *
+ * savepages/loadpage do the actual disk I/O and sleep; the caller has to
+ * hold swap_lock so that a page-in can't overtake the page-out of the
+ * same slot. Page-outs of consecutive slots go to the disk as a single
+ * transfer, which is why bitmap_alloc handing out the lowest free slot
+ * matters: victims picked together usually end up next to each other.
+ *
+ * Pages only reach the disk through the compressed cache in zswap.c,
+ * which keeps as many of them in memory as it can.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <clock.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+static struct vnode *swap_vnode;   // raw swap disk, NULL if swapping is off
+static struct bitmap *swap_map;    // allocated slots
+static u_int16_t *swap_refs;       // # of PTEs pointing at each slot
+static u_int32_t swap_nslots;
+
+/* Counters for sizing RAM against the paging rate */
+static u_int32_t swap_ins;
+static u_int32_t swap_outs;
+static u_int32_t swap_writes;   // disk transfers the swap-outs took
+static u_int32_t swap_inuse;
+
+/*
+ * Open the swap disk and set up the slot bitmap. Called from
+ * vm_bootstrap, after the devices have been attached.
+ * If there is no swap disk the system just runs without swap.
+ */
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_DEVICE)];
+	int result;
+
+	swap_vnode = NULL;
+	swap_ins = swap_outs = swap_writes = swap_inuse = 0;
+
+	swap_lock = lock_create("swap lock");
+	if (swap_lock == NULL){
+		panic("swap: Could not create swap lock\n");
+	}
+
+	// vfs_open may scribble on the name
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, &swap_vnode);
+	if (result){
+		kprintf("swap: no swap device %s (%s), swapping disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result){
+		panic("swap: Could not stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots > SWAP_MAXSLOTS){
+		swap_nslots = SWAP_MAXSLOTS;
+	}
+	if (swap_nslots == 0){
+		kprintf("swap: %s is too small, swapping disabled\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(u_int16_t));
+	if (swap_map == NULL || swap_refs == NULL){
+		panic("swap: Out of memory\n");
+	}
+	bzero(swap_refs, swap_nslots * sizeof(u_int16_t));
+	zswap_bootstrap(swap_nslots);
+
+	kprintf("swap: %uk on %s\n", swap_nslots * PAGE_SIZE / 1024,
+		SWAP_DEVICE);
+}
+
+/* Nonzero if there is somewhere to page out to */
+int
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+/*
+ * Grab a free swap slot. Returns ENOSPC when the swap disk is full.
+ */
+int
+swap_alloc(int *slot)
+{
+	u_int32_t index;
+	int spl, result;
+
+	if (swap_vnode == NULL){
+		return ENOSPC;
+	}
+
+	spl = splhigh();
+	result = bitmap_alloc(swap_map, &index);
+	if (result){
+		splx(spl);
+		return ENOSPC;
+	}
+	swap_refs[index] = 1;
+	swap_inuse++;
+	splx(spl);
+
+	*slot = index;
+	return 0;
+}
+
+/* One more PTE refers to this slot (fork of a swapped-out page) */
+void
+swap_share(int slot)
+{
+	int spl;
+
+	assert(slot >= 0 && (u_int32_t)slot < swap_nslots);
+
+	spl = splhigh();
+	assert(swap_refs[slot] > 0);
+	swap_refs[slot]++;
+	splx(spl);
+}
+
+/* How many PTEs refer to this slot */
+int
+swap_refcount(int slot)
+{
+	assert(slot >= 0 && (u_int32_t)slot < swap_nslots);
+	return swap_refs[slot];
+}
+
+/* Drop a reference to a slot, freeing it when it was the last one */
+void
+swap_free(int slot)
+{
+	int spl;
+
+	assert(slot >= 0 && (u_int32_t)slot < swap_nslots);
+
+	spl = splhigh();
+	assert(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0){
+		zswap_invalidate(slot);
+		bitmap_unmark(swap_map, slot);
+		swap_inuse--;
+	}
+	splx(spl);
+}
+
+/*
+ * Writes npages pages from the kernel buffer buf straight to the swap
+ * disk, starting at slot "slot", in one transfer.
+ * Caller must hold swap_lock.
+ */
+int
+swap_write(const void *buf, int slot, int npages)
+{
+	struct uio ku;
+	int result;
+
+	assert(lock_do_i_hold(swap_lock));
+	assert(npages > 0);
+	assert(slot >= 0 && (u_int32_t)(slot + npages) <= swap_nslots);
+
+	mk_kuio(&ku, (void *)buf, npages * PAGE_SIZE, slot * PAGE_SIZE,
+		UIO_WRITE);
+	result = VOP_WRITE(swap_vnode, &ku);
+	if (result){
+		return result;
+	}
+
+	swap_writes++;
+	DEBUG(DB_VM, "swap: out %d pages -> slot %d\n", npages, slot);
+	return 0;
+}
+
+/*
+ * Swaps out npages pages from the kernel buffer buf to the slots
+ * starting at "slot". The ones the compressed cache won't take are
+ * written to disk, one transfer per run of them.
+ * Caller must hold swap_lock.
+ */
+int
+savepages(const void *buf, int slot, int npages)
+{
+	const char *page = buf;
+	int i, start, result;
+
+	assert(lock_do_i_hold(swap_lock));
+	assert(npages > 0);
+
+	start = -1;
+	for (i = 0; i <= npages; i++){
+		if (i < npages && zswap_store(slot + i, page + i * PAGE_SIZE)){
+			if (start == -1){
+				start = i;
+			}
+			continue;
+		}
+		if (start != -1){
+			result = swap_write(page + start * PAGE_SIZE, slot + start,
+					    i - start);
+			if (result){
+				return result;
+			}
+			start = -1;
+		}
+	}
+
+	swap_outs += npages;
+	return 0;
+}
+
+/*
+ * Reads swap slot "slot" into the physical page at paddr.
+ * Caller must hold swap_lock.
+ */
+int
+loadpage(int slot, paddr_t paddr)
+{
+	struct uio ku;
+	time_t secs1, secs2, secs;
+	u_int32_t nsecs1, nsecs2, nsecs;
+	int result, hit;
+
+	assert(lock_do_i_hold(swap_lock));
+	assert(slot >= 0 && (u_int32_t)slot < swap_nslots);
+
+	gettime(&secs1, &nsecs1);
+
+	hit = (zswap_load(slot, (void *)PADDR_TO_KVADDR(paddr)) == 0);
+	if (!hit){
+		mk_kuio(&ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			slot * PAGE_SIZE, UIO_READ);
+		result = VOP_READ(swap_vnode, &ku);
+		if (result){
+			return result;
+		}
+		if (ku.uio_resid != 0){
+			return EIO;
+		}
+	}
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	zswap_account(hit, secs * 1000000 + nsecs / 1000);
+
+	swap_ins++;
+	DEBUG(DB_VM, "swap: in slot %d -> 0x%x%s\n", slot, paddr,
+	      hit ? " (compressed)" : "");
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	if (swap_vnode == NULL){
+		kprintf("swap: disabled\n");
+		return;
+	}
+	kprintf("swap: %u/%u slots in use, %u swap-ins, %u swap-outs "
+		"in %u writes\n", swap_inuse, swap_nslots, swap_ins, swap_outs,
+		swap_writes);
+	zswap_printstats();
+}
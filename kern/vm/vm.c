@@ -9,16 +9,29 @@
 #include <machine/tlb.h>
 #include <kern/types.h>
 #include <synch.h>
+#include <clock.h>
+#include <array.h>
 
 // toggle debug prints
 //#define VM_DEBUG 1
 
+/* Counters */
+static u_int32_t vm_faults;    // calls to vm_fault
+static u_int32_t asid_wraps;   // full TLB flushes
+static u_int32_t zero_maps;    // reads satisfied with the zero page
+static u_int32_t zero_fills;   // private zeroed pages handed out
+static u_int32_t oom_kills;    // processes killed to free memory
 
-// TODO: using dumbvm still; replace with proper
-// TODO: test tlb replacement to see if it works
+/* Caches vm.c can shrink when memory runs out */
+static struct shrinker zpool_shrinker;
+static struct shrinker pagecache_shrinker;
+u_int32_t utlb_refills;        // misses handled by utlb_refill in exception.S
+
+/* Walked by utlb_refill, kept in step with the current ASID */
+struct page_table **curpgdir;
 
-// dumb
-#define DUMBVM_STACKPAGES    12
+
+// TODO: test tlb replacement to see if it works
 
 // debugging function
 // print tlb entries
@@ -43,303 +56,1744 @@ void printtlb(void)
 	}
 
 }
+/*
+ * TLB replacement.
+ *
+ * tlb_load asks the current policy for a slot when the page isn't in
+ * the TLB yet. Slots we know to be empty are always used first.
+ *
+ *   rr     - round robin over the slots
+ *   random - let the hardware pick (TLBWR)
+ *   lru    - approximate LRU: a clock hand over the slots gives entries
+ *            loaded since its last pass a second chance. An entry of
+ *            the current address space whose page had its PTE ref bit
+ *            cleared by page replacement (and hasn't faulted since) is
+ *            taken straight away.
+ *
+ * Misses handled by utlb_refill always use TLBWR, so the policies only
+ * decide for the misses that go through vm_fault.
+ */
+static int rr_slot(void);
+static int random_slot(void);
+static int lru_slot(void);
+static int tlb_cold(int slot);
+static void zpool_printstats(void);
+static void fa_printstats(void);
+static void pageout_bootstrap(void);
+static void pageout_printstats(void);
+static int zpool_shrink(int npages);
+static int pagecache_shrink(int npages);
+static void pagecache_free(int index);
+
+static const struct tlbpolicy {
+	const char *name;
+	int (*slot)(void);    // slot to load into, -1 for a random one
+} tlbpolicies[] = {
+	{ "rr",		rr_slot },
+	{ "random",	random_slot },
+	{ "lru",	lru_slot },
+	{ NULL, NULL }
+};
+
+static const struct tlbpolicy *tlbpolicy = &tlbpolicies[0];
+
+static int tlb_hand;                // next slot for rr and lru
+static char tlb_empty[NUM_TLB];     // slot known to hold no translation
+static int tlb_nempty;              // # of those
+static char tlb_used[NUM_TLB];      // loaded since the lru hand went by
+static u_int32_t tlb_refills_seen;  // utlb_refills when tlb_empty was right
+
+/* Miss counts since the policy was picked */
+static u_int32_t tlb_misses;        // misses that went through vm_fault
+static u_int32_t tlb_refills_base;  // utlb_refills when the policy was picked
+static time_t tlb_since_secs;
+static u_int32_t tlb_since_nsecs;
+
+/* Keep track of which slots hold something */
+static
+void
+tlb_mark(int slot, int empty)
+{
+	if (tlb_empty[slot] != empty){
+		tlb_nempty += empty ? 1 : -1;
+	}
+	tlb_empty[slot] = empty;
+	tlb_used[slot] = !empty;
+}
+
+static
+int
+rr_slot(void)
+{
+	int slot = tlb_hand;
+
+	tlb_hand = (tlb_hand + 1) % NUM_TLB;
+	return slot;
+}
+
+static
+int
+random_slot(void)
+{
+	return -1;
+}
+
+static
+int
+lru_slot(void)
+{
+	int i, slot;
+
+	// After one pass every second chance is used up
+	for (i = 0; i <= NUM_TLB; i++){
+		slot = rr_slot();
+		if (!tlb_used[slot] || tlb_cold(slot)){
+			return slot;
+		}
+		tlb_used[slot] = 0;
+	}
+	return slot;
+}
+
+/*
+ * utlb_refill loads entries into random slots behind our back, so once
+ * it has run, slots we think are empty have to be checked again.
+ */
+static
+void
+tlb_resync(void)
+{
+	u_int32_t ehi, elo;
+	int i;
+
+	for (i = 0; i < NUM_TLB && tlb_nempty > 0; i++){
+		if (tlb_empty[i]){
+			TLB_Read(&ehi, &elo, i);
+			if (elo & TLBLO_VALID){
+				tlb_mark(i, 0);
+			}
+		}
+	}
+	tlb_refills_seen = utlb_refills;
+}
+
+/* Pick the slot to load a new translation into, -1 for TLBWR */
+static
+int
+tlb_slot(void)
+{
+	int i;
+
+	if (tlb_nempty > 0 && tlb_refills_seen != utlb_refills){
+		tlb_resync();
+	}
+	if (tlb_nempty > 0){
+		for (i = 0; i < NUM_TLB; i++){
+			if (tlb_empty[i]){
+				return i;
+			}
+		}
+	}
+	return tlbpolicy->slot();
+}
+
+int
+tlb_setpolicy(const char *name)
+{
+	int i, spl;
+
+	for (i = 0; tlbpolicies[i].name != NULL; i++){
+		if (!strcmp(name, tlbpolicies[i].name)){
+			spl = splhigh();
+			tlbpolicy = &tlbpolicies[i];
+			tlb_misses = 0;
+			tlb_refills_base = utlb_refills;
+			gettime(&tlb_since_secs, &tlb_since_nsecs);
+			splx(spl);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+static
+void
+tlb_printstats(void)
+{
+	time_t now_secs, secs;
+	u_int32_t now_nsecs, nsecs, misses;
+
+	gettime(&now_secs, &now_nsecs);
+	getinterval(tlb_since_secs, tlb_since_nsecs, now_secs, now_nsecs,
+		    &secs, &nsecs);
+	misses = tlb_misses + (utlb_refills - tlb_refills_base);
+
+	kprintf("tlb: %s, %u misses (%u in vm_fault) in %d.%02u s",
+		tlbpolicy->name, misses, tlb_misses, secs, nsecs / 10000000);
+	if (secs > 0){
+		kprintf(", %u/s", misses / secs);
+	}
+	kprintf("\n");
+}
+
 void
 vm_bootstrap(void)
 {
-	nextEvict = 0;
+	vaddr_t zerova;
+	int i;
+
+	for (i = 0; i < NUM_TLB; i++){
+		tlb_mark(i, 1);
+	}
+	gettime(&tlb_since_secs, &tlb_since_nsecs);
+
+	// Shared by every untouched heap and stack page that gets read
+	zerova = alloc_kpages(1);
+	if (zerova == 0){
+		panic("vm: Could not allocate the zero page\n");
+	}
+	bzero((void *)zerova, PAGE_SIZE);
+	zeropage = KVADDR_TO_PADDR(zerova);
+
 	coremap_lock = lock_create("coremap lock");
+	shrinker_register(&zpool_shrinker, "zero pool", zpool_shrink);
+	shrinker_register(&pagecache_shrinker, "page cache", pagecache_shrink);
+	pagecache_bootstrap();
+	swap_bootstrap();
+	pageout_bootstrap();
+	ksm_bootstrap();
+}
+
+void
+vm_printstats(void)
+{
+	kprintf("coremap: %d/%d pages free, %u oom kills\n",
+		coremap_freepages(), coremap_size, oom_kills);
+	kprintf("tlb: %u refills, %u faults, %u full flushes (ASID wrap)\n",
+		utlb_refills, vm_faults, asid_wraps);
+	tlb_printstats();
+	kprintf("zero: %u reads mapped the zero page, %u pages zero-filled\n",
+		zero_maps, zero_fills);
+	zpool_printstats();
+	fa_printstats();
+	pageout_printstats();
+	shrink_printstats();
+	ksm_printstats();
+	replace_printstats();
+	pagecache_printstats();
+	swap_printstats();
 }
 
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of their address space, so a
+ * context switch doesn't have to flush the TLB. as_asid keeps the
+ * generation the ASID was handed out in above the low 6 bits. When an
+ * address space from an old generation is activated it gets a fresh
+ * ASID; once all of them are used up the generation moves on and the
+ * TLB is flushed, which retires every ASID handed out so far at once.
+ * ASID 0 is never handed out, so as_asid == 0 means "none".
+ */
+#define ASID_MASK (NUM_ASID - 1)
+
+static u_int32_t asid_generation = NUM_ASID;
+static u_int32_t asid_next = 1;
 
-// simple tlb replacement policy
-static int robinEvict(void)
+static
+void
+tlb_flush(void)
 {
-	if (nextEvict==NUM_TLB)
-	{
-		nextEvict = 0;
-	}	
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		tlb_mark(i, 1);
+	}
+}
+
+/* Nonzero if as may have entries in the TLB */
+static
+int
+asid_valid(struct addrspace *as)
+{
+	return (as->as_asid & ~ASID_MASK) == asid_generation;
+}
+
+/* TLBHI PID field for as */
+static
+u_int32_t
+asid_tlbhi(struct addrspace *as)
+{
+	return (as->as_asid & ASID_MASK) << TLBHI_PIDSHIFT;
+}
+
+/*
+ * Make as the address space the TLB translates for, giving it a new
+ * ASID first if its old one has been recycled.
+ * Interrupts must be off.
+ */
+void
+asid_activate(struct addrspace *as)
+{
+	if (!asid_valid(as)){
+		if (asid_next == NUM_ASID){
+			asid_generation += NUM_ASID;
+			if (asid_generation == 0){
+				asid_generation = NUM_ASID;
+			}
+			asid_next = 1;
+			tlb_flush();
+			asid_wraps++;
+		}
+		as->as_asid = asid_generation | asid_next++;
+	}
+	TLB_SetASID(as->as_asid & ASID_MASK);
+	curpgdir = as->page_directory;
+}
+
+/*
+ * Throw away all TLB entries of as. Cheaper than hunting them down one
+ * by one: the old ASID is just abandoned and as gets a new one.
+ * Interrupts must be off.
+ */
+void
+tlb_flushas(struct addrspace *as)
+{
+	as->as_asid = 0;
+	if (as == curthread->t_vmspace){
+		asid_activate(as);
+	}
+}
+
+/*
+ * Drop the TLB entry for vaddr in as, if there is one.
+ * Interrupts must be off.
+ */
+void
+tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	int i;
+
+	if (!asid_valid(as)){
+		return;
+	}
+
+	i = TLB_Probe(vaddr | asid_tlbhi(as), 0);
+	if (i >= 0){
+		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		tlb_mark(i, 1);
+	}
+}
+
+/*
+ * Nonzero if the entry in slot belongs to the current address space and
+ * page replacement has found its page unreferenced.
+ */
+static
+int
+tlb_cold(int slot)
+{
+	struct addrspace *as = curthread->t_vmspace;
+	u_int32_t ehi, elo;
+	int *pte;
+
+	if (as == NULL || !asid_valid(as)){
+		return 0;
+	}
+
+	TLB_Read(&ehi, &elo, slot);
+	if ((ehi & TLBHI_PID) != asid_tlbhi(as)){
+		return 0;
+	}
+	pte = find_pte(as, ehi & TLBHI_VPAGE, 0);
+	return pte != NULL && !IS_REF(*pte);
+}
+
+
+
+// Not used
+/*
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	int spl;
+	paddr_t addr;
+	spl = splhigh();
+
+	addr = ram_stealmem(npages);
+
+	splx(spl);
+	return addr;
+}
+*/
+
+
+
+/*
+ * Buddy allocator
+ *
+ * free_area[k] is the coremap index of the first free block of order k,
+ * or -1 if there is none. Blocks are doubly linked through next_free and
+ * prev_free so any block can be unlinked in O(1) when its buddy frees.
+ * All of these must be called with interrupts off.
+ */
+static int free_area[BUDDY_MAX_ORDER + 1];
+static int free_pages;
+
+/* Push the block headed by index onto the free list for order */
+static
+void
+buddy_push(int index, int order)
+{
+	int head = free_area[order];
+
+	coremap[index].pstate = PFREE;
+	coremap[index].order = order;
+	coremap[index].prev_free = -1;
+	coremap[index].next_free = head;
+	if (head != -1){
+		coremap[head].prev_free = index;
+	}
+	free_area[order] = index;
+}
+
+/* Unlink the free block headed by index from its free list */
+static
+void
+buddy_unlink(int index)
+{
+	int order = coremap[index].order;
+	int prev = coremap[index].prev_free;
+	int next = coremap[index].next_free;
+
+	assert(coremap[index].pstate == PFREE);
+	assert(order >= 0 && order <= BUDDY_MAX_ORDER);
+
+	if (prev != -1){
+		coremap[prev].next_free = next;
+	}
+	else{
+		free_area[order] = next;
+	}
+	if (next != -1){
+		coremap[next].prev_free = prev;
+	}
+
+	coremap[index].next_free = -1;
+	coremap[index].prev_free = -1;
+}
+
+/*
+ * Take a block of 2^order pages off the free lists, splitting a larger
+ * block if nothing of the right size is free.
+ * Returns the coremap index of the block, or -1 if none is big enough.
+ */
+static
+int
+buddy_alloc(int order)
+{
+	int k, index;
+
+	// Find the smallest order that has a free block
+	for (k = order; k <= BUDDY_MAX_ORDER; k++){
+		if (free_area[k] != -1){
+			break;
+		}
+	}
+	if (k > BUDDY_MAX_ORDER){
+		return -1;
+	}
+
+	index = free_area[k];
+	buddy_unlink(index);
 
-	return nextEvict++;
+	// Split down, handing the upper half back each time
+	while (k > order){
+		k--;
+		buddy_push(index + (1 << k), k);
+	}
+
+	coremap[index].order = order;
+	free_pages -= (1 << order);
+	return index;
+}
+
+/*
+ * Give the block of 2^order pages at index back, merging it with its
+ * buddy for as long as the buddy is also a whole free block.
+ */
+static
+void
+buddy_free(int index, int order)
+{
+	int buddy;
+
+	free_pages += (1 << order);
+
+	while (order < BUDDY_MAX_ORDER){
+		buddy = index ^ (1 << order);
+
+		// The buddy has to exist and be a free block of the same size
+		if (buddy + (1 << order) > coremap_size ||
+		    coremap[buddy].pstate != PFREE ||
+		    coremap[buddy].order != order){
+			break;
+		}
+
+		buddy_unlink(buddy);
+		coremap[buddy].order = -1;
+
+		// Merged block is headed by the lower of the two
+		if (buddy < index){
+			coremap[index].order = -1;
+			index = buddy;
+		}
+		order++;
+	}
+
+	buddy_push(index, order);
+}
+
+/* Smallest order whose block holds npages */
+static
+int
+buddy_order(int npages)
+{
+	int order = 0;
+
+	while ((1 << order) < npages){
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Pre-zeroed pages.
+ *
+ * While there is nothing to run the idle loop calls vm_prezero, which
+ * takes a free page, clears it and puts it on the zero pool. zero_fill
+ * and kzalloc take their pages from the pool first, so the bzero has
+ * been paid for while the CPU had nothing better to do. Everything else
+ * only dips into the pool once the buddy allocator runs dry, and bigger
+ * blocks get the pool handed back so that its pages can merge again.
+ * Pool pages are PZERO and linked through next_free.
+ * All of these must be called with interrupts off.
+ */
+#define ZPOOL_TARGET 32    // pages to keep zeroed ahead of time
+#define ZPOOL_MINFREE 16   // never take the buddy allocator below this
+
+static int zpool = -1;          // first pre-zeroed page, -1 if none
+static int zpool_size;
+static u_int32_t zpool_zeroed;  // pages cleared by the idle loop
+static u_int32_t zpool_hits;    // zeroed pages that came from the pool
+static u_int32_t zpool_misses;  // ... that had to be cleared on the spot
+
+int
+vm_prezero(void)
+{
+	int index;
+
+	assert(curspl>0);
+
+	if (zpool_size >= ZPOOL_TARGET || free_pages <= ZPOOL_MINFREE){
+		return 0;
+	}
+
+	index = buddy_alloc(0);
+	if (index == -1){
+		return 0;
+	}
+	bzero((void *)PADDR_TO_KVADDR(coremap[index].paddr), PAGE_SIZE);
+
+	coremap[index].pstate = PZERO;
+	coremap[index].next_free = zpool;
+	zpool = index;
+	zpool_size++;
+	zpool_zeroed++;
+	return 1;
+}
+
+/* Take a page off the zero pool, -1 if it is empty */
+static
+int
+zpool_take(void)
+{
+	int index = zpool;
+
+	if (index != -1){
+		assert(coremap[index].pstate == PZERO);
+		zpool = coremap[index].next_free;
+		coremap[index].next_free = -1;
+		zpool_size--;
+	}
+	return index;
+}
+
+/*
+ * Shrinker for the zero pool. Gives the whole pool back to the buddy
+ * allocator whatever npages is, so that freed pages can merge into
+ * bigger blocks again. Returns the number of pages handed back.
+ */
+static
+int
+zpool_shrink(int npages)
+{
+	int index, n;
+
+	(void)npages;
+
+	n = 0;
+	while ((index = zpool_take()) != -1){
+		buddy_free(index, 0);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Take a single free page, from the buddy allocator or the zero pool.
+ * If zeroed is set the page comes back cleared, from the pool if it can.
+ * Returns the coremap index, -1 if there is no free page at all.
+ */
+static
+int
+frame_alloc(int zeroed)
+{
+	int index;
+
+	if (zeroed){
+		index = zpool_take();
+		if (index != -1){
+			zpool_hits++;
+			return index;
+		}
+	}
+
+	index = buddy_alloc(0);
+	if (index == -1){
+		// Only the pool is left, its pages are as good as any other
+		index = zpool_take();
+	}
+	if (index != -1 && zeroed){
+		bzero((void *)PADDR_TO_KVADDR(coremap[index].paddr), PAGE_SIZE);
+		zpool_misses++;
+	}
+	return index;
+}
+
+static
+void
+zpool_printstats(void)
+{
+	kprintf("zero pool: %d/%d pages, %u zeroed while idle, %u pool hits, "
+		"%u zeroed on demand\n", zpool_size, ZPOOL_TARGET, zpool_zeroed,
+		zpool_hits, zpool_misses);
+}
+
+int
+coremap_freepages(void)
+{
+	return free_pages + zpool_size;
+}
+
+
+// ppage_start should be different after implement swapping
+// should consider how swap implementation change ppage range & start
+void
+coremap_bootstrap(void){
+
+	// firstaddr & lastaddr to calculate page # we get
+	// corebase -> first actual paddr for free pages
+	paddr_t firstaddr, lastaddr;
+	int ppagenumber, coremap_pages, i, order;
+
+	lastaddr = mips_ramsize();
+	firstaddr = ram_stealmem(0);
+
+	// The coremap itself lives in the first few pages we steal, so
+	// only the pages after it need an entry
+	ppagenumber = (lastaddr - firstaddr) / PAGE_SIZE;
+	coremap_pages = (ppagenumber * sizeof(struct coremap_entry)
+			 + PAGE_SIZE - 1) / PAGE_SIZE;
+	ppagenumber -= coremap_pages;
+	coremap_size = ppagenumber;
+
+	// Initalize coremap by using ram_stealmem since kmalloc isnt available yet
+	// Find the actual start of the physical memory
+	coremap = (struct coremap_entry *)
+		PADDR_TO_KVADDR(ram_stealmem(coremap_pages));
+	corebase = ram_stealmem(0);
+		
+
+	// Initialize page state and paddr for each page
+	for(i = 0 ; i < ppagenumber; i++){
+		coremap[i].pid = 0;
+		coremap[i].vaddr = 0;
+		coremap[i].block_size = 0;
+		coremap[i].pstate = PFREE;
+		coremap[i].refcount = 0;
+		coremap[i].as = NULL;
+		coremap[i].swapslot = -1;
+		coremap[i].loadtime = 0;
+		coremap[i].pc_vnode = NULL;
+		coremap[i].pc_next = -1;
+		coremap[i].paddr = CMINDEX_TO_PADDR(i);
+		coremap[i].order = -1;
+		coremap[i].next_free = -1;
+		coremap[i].prev_free = -1;
+	}
+
+	for (order = 0; order <= BUDDY_MAX_ORDER; order++){
+		free_area[order] = -1;
+	}
+	free_pages = 0;
+
+	// Carve the pages into the largest aligned blocks that fit
+	i = 0;
+	while (i < ppagenumber){
+		order = BUDDY_MAX_ORDER;
+		while ((i & ((1 << order) - 1)) != 0 ||
+		       i + (1 << order) > ppagenumber){
+			order--;
+		}
+		buddy_push(i, order);
+		free_pages += (1 << order);
+		i += (1 << order);
+	}
+}
+
+
+
+/*
+ * Page replacement.
+ *
+ * A frame can be pushed out to swap if it holds a user page mapped by
+ * exactly one known PTE. Shared (copy-on-write) pages and pages that are
+ * still being filled in by a fault are skipped. Which of the candidates
+ * goes is up to the replacement policy (vm/replace.c).
+ *
+ * Returns the PTE that maps the page at index, or NULL if it can't be
+ * evicted. Interrupts must be off.
+ */
+int *
+coremap_evictable(int index)
+{
+	struct coremap_entry *cme = &coremap[index];
+	int *pte;
+
+	if (cme->pstate != PDIRTY && cme->pstate != PCLEAN){
+		return NULL;
+	}
+	if (cme->refcount != 1 || cme->as == NULL){
+		return NULL;
+	}
+
+	pte = find_pte(cme->as, cme->vaddr, 0);
+	if (pte == NULL || !IS_VALID(*pte) ||
+	    GET_PFN(*pte) != cme->paddr / PAGE_SIZE){
+		return NULL;
+	}
+	return pte;
+}
+
+/*
+ * Pageout.
+ *
+ * A kernel thread keeps the number of free frames between two
+ * watermarks. Allocations that leave fewer than pageout_low free pages
+ * wake it, and it pushes user pages out until pageout_high are free
+ * again, so a fault normally finds a frame without waiting on the disk.
+ * If the daemon falls behind, the faulting thread evicts a page itself
+ * (coremap_evict).
+ *
+ * Dirty victims are copied into pageout_buf and written out together,
+ * one disk transfer per run of consecutive swap slots.
+ */
+#define PAGEOUT_CLUSTER 8   // pages written out per pass, at most
+
+static struct thread *pageout_thread;  // NULL until it has been forked
+static char *pageout_buf;              // PAGEOUT_CLUSTER pages
+static int pageout_low;
+static int pageout_high;
+
+/* Counters */
+static u_int32_t pageout_wakeups;  // times the daemon was woken
+static u_int32_t pageout_pages;    // frames it freed
+static u_int32_t pageout_direct;   // frames faulting threads had to free
+
+/*
+ * Push up to max user pages out and give their frames back to the
+ * allocator. Returns the number of frames freed.
+ *
+ * Each frame is freed as soon as its contents are safe: a clean page
+ * is just dropped, a dirty one once it has been copied to pageout_buf.
+ * The copies go to disk at the end. swap_lock is taken before the
+ * victims are picked and held until they are on disk, so a fault on one
+ * of those pages (which goes through swap_in and needs the lock) can't
+ * read its slot early. May sleep.
+ */
+static
+int
+pageout(int max)
+{
+	struct coremap_entry *cme;
+	int slots[PAGEOUT_CLUSTER];
+	int index, slot, ndirty, nfreed, i, run, spl, result;
+	int *pte;
+
+	assert(max > 0 && max <= PAGEOUT_CLUSTER);
+
+	// Can't wait for the disk in an interrupt handler, and must not
+	// recurse from inside swap I/O
+	if (!swap_enabled() || in_interrupt || lock_do_i_hold(swap_lock)){
+		return 0;
+	}
+
+	lock_acquire(swap_lock);
+	spl = splhigh();
+
+	ndirty = 0;
+	for (nfreed = 0; nfreed < max; nfreed++){
+		index = replace_victim();
+		if (index == -1){
+			break;
+		}
+
+		cme = &coremap[index];
+		pte = coremap_evictable(index);
+		assert(pte != NULL);
+
+		// An untouched page of the executable can just be read in again
+		if (cme->pstate == PCLEAN && cme->swapslot == -1){
+			*pte = SET_ELF(GET_PROT(*pte));
+			tlb_invalidate(cme->as, cme->vaddr);
+
+			cme->pstate = PKERNEL;
+			pagecache_remove(index);
+		}
+		else{
+			// A clean page already has an up to date copy in its slot
+			slot = cme->swapslot;
+			if (slot == -1 && swap_alloc(&slot)){
+				break;
+			}
+
+			// From here on a fault on this page goes to swap_in
+			*pte = SET_SWAPPED(*pte, slot);
+			tlb_invalidate(cme->as, cme->vaddr);
+
+			if (cme->pstate == PDIRTY){
+				memmove(pageout_buf + ndirty * PAGE_SIZE,
+					(void *)PADDR_TO_KVADDR(cme->paddr),
+					PAGE_SIZE);
+				slots[ndirty++] = slot;
+			}
+			cme->pstate = PKERNEL;
+		}
+
+		// Any slot reference now belongs to the PTE
+		cme->as->as_rss--;
+		cme->as = NULL;
+		cme->vaddr = 0;
+		cme->swapslot = -1;
+		cme->refcount = 0;
+		cme->block_size = 0;
+		buddy_free(index, 0);
+	}
+
+	// Slots come off the bitmap lowest first, so they mostly line up
+	for (i = 0; i < ndirty; i += run){
+		for (run = 1; i + run < ndirty && slots[i + run] == slots[i] + run;
+		     run++){
+			/* nothing */
+		}
+		result = savepages(pageout_buf + i * PAGE_SIZE, slots[i], run);
+		if (result){
+			panic("swap: page-out to slot %d failed: %s\n",
+			      slots[i], strerror(result));
+		}
+	}
+
+	splx(spl);
+	lock_release(swap_lock);
+	return nfreed;
+}
+
+/*
+ * Swap one user page out on behalf of an allocation that found memory
+ * full. Returns 0 if a frame was freed, ENOMEM if nothing could be
+ * evicted.
+ */
+static
+int
+coremap_evict(void)
+{
+	if (pageout(1) == 0){
+		return ENOMEM;
+	}
+	pageout_direct++;
+	return 0;
+}
+
+/* Wake the daemon if free memory is below the low watermark */
+static
+void
+pageout_check(void)
+{
+	if (pageout_thread != NULL && coremap_freepages() < pageout_low){
+		thread_wakeup(&pageout_thread);
+	}
+}
+
+static
+void
+pageout_daemon(void *unused1, unsigned long unused2)
+{
+	int spl, freed;
+
+	(void)unused1;
+	(void)unused2;
+
+	spl = splhigh();
+	for (;;){
+		thread_sleep(&pageout_thread);
+		pageout_wakeups++;
+
+		while (coremap_freepages() < pageout_high){
+			freed = pageout(PAGEOUT_CLUSTER);
+			if (freed == 0){
+				// Nothing evictable, wait for the next wakeup
+				break;
+			}
+			pageout_pages += freed;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Set the watermarks from the amount of memory and start the daemon.
+ * Without swap there is nothing for it to do.
+ */
+static
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_low = coremap_size / 32;
+	if (pageout_low < PAGEOUT_CLUSTER){
+		pageout_low = PAGEOUT_CLUSTER;
+	}
+	pageout_high = pageout_low + 2 * PAGEOUT_CLUSTER;
+
+	if (!swap_enabled()){
+		return;
+	}
+
+	pageout_buf = kmalloc(PAGEOUT_CLUSTER * PAGE_SIZE);
+	if (pageout_buf == NULL){
+		panic("vm: Could not allocate the pageout buffer\n");
+	}
+	result = thread_fork("pageout", NULL, 0, pageout_daemon,
+			     &pageout_thread);
+	if (result){
+		panic("vm: Could not start the pageout daemon: %s\n",
+		      strerror(result));
+	}
+}
+
+static
+void
+pageout_printstats(void)
+{
+	kprintf("pageout: watermarks %d/%d, %u wakeups, %u pages freed ahead, "
+		"%u freed by faulting threads\n", pageout_low, pageout_high,
+		pageout_wakeups, pageout_pages, pageout_direct);
+}
+
+
+/*
+ * Shrinker for the page cache: gives up to npages executable pages that
+ * nobody maps anymore back to the allocator. Cheaper than swapping user
+ * pages out, so it runs before that. Returns the number of pages freed.
+ */
+static
+int
+pagecache_shrink(int npages)
+{
+	int index, n;
+
+	for (n = 0; n < npages; n++){
+		index = pagecache_reclaim();
+		if (index == -1){
+			break;
+		}
+		pagecache_free(index);
+	}
+	return n;
+}
+
+/* Give a frame taken out of the page cache back to the allocator */
+static
+void
+pagecache_free(int index)
+{
+	coremap[index].vaddr = 0;
+	coremap[index].refcount = 0;
+	coremap[index].block_size = 0;
+	buddy_free(index, 0);
+}
+
+/*
+ * The file behind v is about to be written, so none of its cached
+ * pages can be trusted anymore.
+ */
+void
+pagecache_invalidate(struct vnode *v)
+{
+	int index, spl;
+
+	spl = splhigh();
+	while ((index = pagecache_reclaimvnode(v)) != -1){
+		pagecache_free(index);
+	}
+	pagecache_detach(v);
+	splx(spl);
+}
+
+
+/*
+ * Out of memory.
+ *
+ * When nothing is left to shrink or swap out, the process with the most
+ * resident pages is killed. Its user pages are freed on the spot, so
+ * the allocation can be retried right away. The process itself only
+ * finds out on its way back to user mode, where mips_trap makes it
+ * _exit. Its page tables and regions stay until then, so if it is
+ * asleep in the middle of a fault it just finds its PTEs empty.
+ *
+ * Nobody is killed for an allocation made with swap_lock held: that is
+ * swap I/O (a zswap entry, say), which is better off failing and going
+ * to disk. Nor for more than one page, since that is usually
+ * fragmentation, not memory running out.
+ *
+ * Returns the number of frames the kill freed, 0 if there was nobody
+ * to kill or its pages were all shared. The callers give up then
+ * instead of killing the next process too.
+ * Interrupts must be off.
+ */
+static
+int
+oom_kill(void)
+{
+	struct thread *t, *victim;
+	struct addrspace *as;
+	struct vm_region *vr;
+	int i, before;
+
+	if (in_interrupt || (swap_lock != NULL && lock_do_i_hold(swap_lock))){
+		return 0;
+	}
+
+	victim = NULL;
+	for (i = 0; i < array_getnum(process_table); i++){
+		t = array_getguy(process_table, i);
+		if (t == NULL || t->t_vmspace == NULL || t->t_oomkilled){
+			continue;
+		}
+		if (victim == NULL ||
+		    t->t_vmspace->as_rss > victim->t_vmspace->as_rss){
+			victim = t;
+		}
+	}
+	if (victim == NULL || victim->t_vmspace->as_rss == 0){
+		return 0;
+	}
+
+	as = victim->t_vmspace;
+	kprintf("oom: killed pid %d (%s), %d resident pages\n", victim->pid,
+		victim->t_name, as->as_rss);
+	victim->t_oomkilled = 1;
+	oom_kills++;
+
+	before = coremap_freepages();
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next){
+		as_unmap(as, vr->vr_start, VR_END(vr));
+	}
+	return coremap_freepages() - before;
+}
+
+
+/* get_ppage, optionally handing out a zeroed page (see frame_alloc) */
+static
+paddr_t
+ppage_alloc(struct addrspace *as, vaddr_t vaddr, int zeroed){
+	
+	assert(vaddr % PAGE_SIZE == 0);
+
+	int spl, index;
+
+	spl= splhigh();
+	while ((index = frame_alloc(zeroed)) == -1){
+		// Memory is full, shrink the kernel caches, push a user page
+		// out to swap, or kill a process and retry
+		if (shrink_caches(1) == 0 && coremap_evict() &&
+		    oom_kill() == 0){
+			splx(spl);
+			return 0;
+		}
+	}
+
+	coremap[index].as = as;
+	coremap[index].block_size = 1;
+	coremap[index].vaddr = vaddr;
+	coremap[index].pstate = PCLEAN;
+	coremap[index].refcount = 1;
+	as->as_rss++;
+	coremap[index].swapslot = -1;
+	assert(coremap[index].pc_vnode == NULL);
+	replace_loaded(index);
+	pageout_check();
+	splx(spl);
+
+	return coremap[index].paddr;
+}
+
+/* 
+ * Main Function. Used to fetch A single free ppage for USER from the coremap 
+ * This should be called in for loop if you want to allocate more than 1 page
+ * Also sets the owning as and vaddr in the coremap_entry for mapping
+ */
+paddr_t
+get_ppage(struct addrspace *as, vaddr_t vaddr){
+	return ppage_alloc(as, vaddr, 0);
+}
+
+/* 
+ * Main function to free a user page when calling as_destroy
+ * Should only be called in as_destroy
+ */
+void
+free_ppage(struct addrspace *as, vaddr_t va, u_int32_t pageframenumber){
+	
+	int spl, index;
+
+	index = PADDR_TO_CMINDEX(pageframenumber * PAGE_SIZE);
+	assert(index >= 0 && index < coremap_size);
+
+	spl= splhigh();
+	
+	// Make sure that the page state is user ( either clean or dirty)
+	assert(coremap[index].pstate != PKERNEL && coremap[index].pstate != PFREE);
+	assert(coremap[index].vaddr == va);
+	assert(coremap[index].refcount > 0);
+
+	// Still mapped copy-on-write by someone else. If the owner is the
+	// one letting go we no longer know which PTE maps the page.
+	coremap[index].refcount--;
+	as->as_rss--;
+	if (coremap[index].refcount > 0){
+		if (coremap[index].as == as){
+			coremap[index].as = NULL;
+		}
+		splx(spl);
+		return;
+	}
+
+	// Keep executable pages for the next process that runs the file
+	if (coremap[index].pc_vnode != NULL){
+		assert(coremap[index].swapslot == -1);
+		pagecache_release(index);
+		splx(spl);
+		return;
+	}
+
+	if (coremap[index].swapslot != -1){
+		swap_free(coremap[index].swapslot);
+		coremap[index].swapslot = -1;
+	}
+
+	coremap[index].as = NULL;
+	coremap[index].vaddr = 0;
+	coremap[index].block_size = 0;
+	buddy_free(index, 0);
+	
+	splx(spl);	
+}
+
+/*
+ * Called by as_copy for every resident page it shares with the child
+ * instead of copying.
+ */
+void
+share_ppage(struct addrspace *as, u_int32_t pageframenumber){
+
+	int spl, index;
+
+	index = PADDR_TO_CMINDEX(pageframenumber * PAGE_SIZE);
+	assert(index >= 0 && index < coremap_size);
+
+	spl = splhigh();
+	assert(coremap[index].pstate != PKERNEL && coremap[index].pstate != PFREE);
+	coremap[index].refcount++;
+	as->as_rss++;
+	splx(spl);
+}
+
+/* given paddr return the pointer to specific coremap_entry */
+struct coremap_entry*
+get_coremapentry( paddr_t paddr){
+
+	/* make sure paddr is page aligned */
+	assert(paddr % PAGE_SIZE == 0);
+
+	int coremap_index = PADDR_TO_CMINDEX(paddr);
+	assert(coremap_index >= 0 && coremap_index < coremap_size);
+
+	return &coremap[coremap_index];
+}
+
+
+/* alloc_kpages, single pages optionally zeroed (see frame_alloc) */
+static
+vaddr_t
+kpages_alloc(int npages, int zeroed)
+{
+	int spl, i, index, order;
+
+	assert(npages > 0);
+	order = buddy_order(npages);
+	if (order > BUDDY_MAX_ORDER){
+		return 0;
+	}
+
+	spl = splhigh();
+	index = (order == 0) ? frame_alloc(zeroed) : buddy_alloc(order);
+	while (index == -1){
+		// Out of pages, make room by shrinking the kernel caches.
+		// If one page is enough, swap out a user page or kill a
+		// process. A bigger block is usually missing because memory
+		// is fragmented, which is not worth killing anyone over.
+		if (shrink_caches(1 << order) == 0 &&
+		    (order != 0 || (coremap_evict() && oom_kill() == 0))){
+			break;
+		}
+		index = (order == 0) ? frame_alloc(zeroed) : buddy_alloc(order);
+	}
+	if (index == -1){
+		// No free block big enough, return 0 for error
+		splx(spl);
+		return 0;
+	}
+
+	// Only first page can contain chunk size
+	coremap[index].block_size = npages;
+
+	// Mark the whole block, the rounded-up tail goes back with it
+	for (i = 0 ; i < (1 << order); i++){
+		coremap[index+i].pstate = PKERNEL;
+		coremap[index+i].vaddr = PADDR_TO_KVADDR(coremap[index+i].paddr);
+		if (i != 0)		
+			coremap[index+i].block_size = 0;
+	}
+	pageout_check();
+	splx(spl);
+
+	return PADDR_TO_KVADDR(coremap[index].paddr);
+}
+
+/* Allocate/free some kernel-space virtual pages, only called by kmalloc */
+vaddr_t
+alloc_kpages(int npages)
+{
+	return kpages_alloc(npages, 0);
+}
+
+/* A single zeroed kernel page, only called by kzalloc */
+vaddr_t
+alloc_kzpage(void)
+{
+	return kpages_alloc(1, 1);
+}
+
+
+
+/* Kernel free pages function, only called by kfree */
+void
+free_kpages(vaddr_t addr)
+{
+	int pageIndex, order, i;
+	int spl;
+
+	// Convert vaddr to paddr
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+
+	// Check if page aligned and compute the coremap index
+	assert((paddr % PAGE_SIZE) == 0);
+	pageIndex = PADDR_TO_CMINDEX(paddr);
+	assert(pageIndex >= 0 && pageIndex < coremap_size);
+
+	spl = splhigh();
+
+	// Only the first ppage of the block has block_size info
+	assert(coremap[pageIndex].pstate == PKERNEL);
+	assert(coremap[pageIndex].block_size != 0);
+	order = coremap[pageIndex].order;
+
+	for (i = 0 ; i < (1 << order); i++){
+		coremap[i+pageIndex].vaddr = 0x0;
+		coremap[i+pageIndex].block_size = 0;
+		coremap[i+pageIndex].order = -1;
+	}
+	buddy_free(pageIndex, order);
+
+	splx(spl);
+}
+
+/*
+ * Put the translation for vaddr into the TLB. If the page is already in
+ * the TLB (e.g. read-only, on a VM_FAULT_READONLY) that slot is reused,
+ * since the TLB must never hold two entries for the same page.
+ * Interrupts must be off.
+ */
+static
+void
+tlb_load(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, int writable)
+{
+	u_int32_t ehi, elo;
+	int i;
+
+	assert(asid_valid(as));
+
+	// virtual page number, tagged with the address space
+	ehi = vaddr | asid_tlbhi(as);
+	elo = paddr | TLBLO_VALID;
+	if (writable){
+		elo |= TLBLO_DIRTY;
+	}
+
+	i = TLB_Probe(ehi, 0);
+	if (i < 0){
+		// pick the TLB entry to evict
+		i = tlb_slot();
+	}
+
+	if (i < 0){
+		// let the hardware choose, then see where it went
+		TLB_Random(ehi, elo);
+		i = TLB_Probe(ehi, 0);
+	}
+	else{
+// for debugging	
+#ifdef VM_DEBUG
+		kprintf ("Current Thread: %x",curthread);
+		kprintf ("Writing to TLB%2d: %8x %8x\n",i,ehi,elo);
+#endif
+		TLB_Write(ehi, elo, i);
+	}
+	assert (i >=0);
+	assert (i < NUM_TLB);
 
+	tlb_mark(i, 0);
 }
-// tells us which tlb entry to evict next
-// returns and int from 0 to 63
-static int evict(void)
+
+/*
+ * A read of a not-yet-touched PTE (stack, heap) maps the shared zero
+ * page. It is never dirty, so it goes into the TLB read-only and the
+ * first write comes back to zero_fill for a private page.
+ */
+static
+void
+zero_map(int *pte)
 {
-	return robinEvict();
+	*pte = SET_VALID(SET_PFN(CLR_COW(*pte), zeropage / PAGE_SIZE));
+	zero_maps++;
 }
 
-
-
-// Not used
 /*
+ * Back a not-yet-touched PTE (stack, heap), or one still on the zero
+ * page, with a zeroed page of its own.
+ * The page has no copy anywhere else, so it starts out dirty.
+ */
 static
-paddr_t
-getppages(unsigned long npages)
+int
+zero_fill(struct addrspace *as, vaddr_t vaddr, int *pte)
 {
-	int spl;
-	paddr_t addr;
-	spl = splhigh();
+	paddr_t paddr;
 
-	addr = ram_stealmem(npages);
+	paddr = ppage_alloc(as, vaddr, 1);
+	if (paddr == 0){
+		return ENOMEM;
+	}
+	coremap[PADDR_TO_CMINDEX(paddr)].pstate = PDIRTY;
+	zero_fills++;
 
-	splx(spl);
-	return addr;
+	*pte = SET_PFN(CLR_COW(*pte), paddr / PAGE_SIZE);
+	*pte = SET_VALID(*pte);
+	*pte = SET_DIRTY(*pte);
+	return 0;
 }
-*/
-
-
 
-//TODO: need to place in main.c 
-// ppage_start should be different after implement swapping
-// should consider how swap implementation change ppage range & start
-void
-coremap_bootstrap(void){
+/*
+ * Write to a copy-on-write page. If some other address space still maps
+ * the frame, copy it into a private page; otherwise we are the last one
+ * and can just take the frame over.
+ */
+static
+int
+cow_split(struct addrspace *as, vaddr_t vaddr, int *pte)
+{
+	paddr_t old_pa, new_pa;
+	int index;
 
-	// firstaddr & lastaddr to calculate page # we get
-	// corebase -> first actual paddr for free pages
-	paddr_t firstaddr, lastaddr;
-	int ppagenumber, i;
+	old_pa = GET_PFN(*pte) * PAGE_SIZE;
+	index = PADDR_TO_CMINDEX(old_pa);
+	assert(coremap[index].refcount > 0);
 
-	lastaddr = mips_ramsize();
-	firstaddr = ram_stealmem(0);
+	if (coremap[index].refcount > 1){
+		new_pa = get_ppage(as, vaddr);
+		if (new_pa == 0){
+			return ENOMEM;
+		}
 
-	// since we need 1 page size for coremap itself
-	ppagenumber = (lastaddr - firstaddr - PAGE_SIZE)/ PAGE_SIZE;
-	coremap_size = ppagenumber;
+		// get_ppage may have slept, and the other sharers may have
+		// gone away and let the page be swapped out meanwhile
+		if (!IS_VALID(*pte) || GET_PFN(*pte) != old_pa / PAGE_SIZE){
+			free_ppage(as, vaddr, new_pa / PAGE_SIZE);
+			return 0;
+		}
+	}
+	else{
+		new_pa = 0;
+	}
 
-	// Initalize coremap by using ram_stealmem since kmalloc isnt available yet
-	// Find the actual start of the physical memory
-	coremap = PADDR_TO_KVADDR(ram_stealmem(1));
-	corebase = ram_stealmem(0);
-		
+	// Recheck: the other sharers may also have exited while we slept
+	if (coremap[index].refcount > 1){
+		memmove((void *)PADDR_TO_KVADDR(new_pa),
+			(const void *)PADDR_TO_KVADDR(old_pa), PAGE_SIZE);
 
-	// Initialize page state and paddr for each page
-	for(i = 0 ; i < ppagenumber; i++){
-		coremap[i].pstate = PFREE;
-		coremap[i].paddr = i * PAGE_SIZE;
+		// Drop our reference to the shared frame
+		coremap[index].refcount--;
+		as->as_rss--;
+		*pte = SET_PFN(*pte, new_pa / PAGE_SIZE);
+	}
+	else{
+		// Last one left, the frame is ours now
+		if (new_pa != 0){
+			free_ppage(as, vaddr, new_pa / PAGE_SIZE);
+		}
+		coremap[index].as = as;
 	}
 
+	*pte = CLR_COW(*pte);
+	return 0;
 }
 
-
-
-/* 
- * Main Function. Used to fetch A single free ppage for USER from the coremap 
- * This should be called in for loop if you want to allocate more than 1 page
- * Also sets pid and vaddr in the coremap_entry for mapping
+/*
+ * First touch of a page of the executable or of a mapped file: read it
+ * in from the file. The page matches the file, so it starts out clean
+ * and can be dropped again later without writing it anywhere (see
+ * coremap_evict). Read-only pages of the executable go through the page
+ * cache, so every process running the same program shares one copy.
  */
-// TODO: change accordingly after swapping, add pid to support multi processes
+static
+int
+elf_in(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr, int *pte)
+{
+	paddr_t paddr, cached;
+	int shared, result;
+
+	shared = !IS_WTABLE(*pte) && vr->vr_type == VR_ELF;
+	if (shared){
+		paddr = pagecache_lookup(as->v, vaddr, as);
+		if (paddr != 0){
+			*pte = SET_VALID(SET_PFN(CLR_COW(GET_PROT(*pte)),
+						 paddr / PAGE_SIZE));
+			return 0;
+		}
+	}
 
-paddr_t
-get_ppage(vaddr_t vaddr){
-	
-	//assert(_pid > 0);	
-	assert(vaddr % PAGE_FRAME == 0);
+	paddr = get_ppage(as, vaddr);
+	if (paddr == 0){
+		return ENOMEM;
+	}
 
-	int spl, i ;
-	paddr_t paddr;
-	spl= splhigh();
+	if (vr->vr_type == VR_FILE){
+		result = mmap_load_page(vr, vaddr, paddr);
+	}
+	else{
+		result = load_elf_page(as, vaddr, paddr);
+	}
+	if (result){
+		free_ppage(as, vaddr, paddr / PAGE_SIZE);
+		return result;
+	}
 
-	// Need to be removed after implement swapping
-	int found = 0;
-	
-	// Loop through the coremap and finds a free page
-	for( i=0 ; i < coremap_size ; i++){
-		
-		/* If you find a free page, set its pid and vaddr 
-		 * to map this page.
-		 */
+	// We slept on the disk, somebody may have beaten us to it
+	if (!IS_ELF(*pte)){
+		free_ppage(as, vaddr, paddr / PAGE_SIZE);
+		return 0;
+	}
 
-		if(coremap[i].pstate == PFREE){
-			found = 1;
-			//coremap[i].pid = _pid;
-			coremap[i].block_size = 1;
-			coremap[i].vaddr = vaddr;
-			coremap[i].pstate = PCLEAN;
-			
-			paddr = coremap[i].paddr;
-			splx(spl);
-			return paddr;	
+	if (shared){
+		cached = pagecache_insert(as->v, vaddr, paddr);
+		if (cached != paddr){
+			free_ppage(as, vaddr, paddr / PAGE_SIZE);
+			paddr = cached;
 		}
 	}
-	
-	// if there is no free page, return 0 
-	// TODO: this should not be allowed if we implement swap
-	if (!found){
-		splx(spl);
-		return 0;
-	}	
+
+	*pte = SET_VALID(SET_PFN(CLR_COW(GET_PROT(*pte)), paddr / PAGE_SIZE));
 	return 0;
 }
 
-/* 
- * Main function to free a user page when calling as_destroy
- * Should only be called in as_destroy
+/*
+ * Bring a swapped-out page back in. If the slot is still shared with
+ * another address space (fork) our copy becomes private and dirty;
+ * otherwise the slot stays attached to the frame, so the page is clean
+ * and can be dropped again later without another write.
+ * Returns 0 with the PTE still not valid if the page changed under us;
+ * the caller then lets the access fault again.
  */
-void
-free_ppage(vaddr_t va, u_int32_t pageframenumber){
-	
-	int spl;
-	spl= splhigh();
-	
-	// Make sure that the page state is user ( either clean or dirty)
-	// TODO: may need to do something 
-	assert(coremap[pageframenumber].pstate != PKERNEL || coremap[pageframenumber].pstate != PFREE);
-	assert(coremap[pageframenumber].vaddr == va);
+static
+int
+swap_in(struct addrspace *as, vaddr_t vaddr, int *pte)
+{
+	paddr_t paddr;
+	int slot, index, result;
 
-	coremap[pageframenumber].pstate = PFREE;
-	//coremap[pageframenumber].pid = 0;
-	coremap[pageframenumber].vaddr = 0;
-	
-	splx(spl);	
-}
+	slot = GET_SWAPSLOT(*pte);
 
-/* given paddr return the pointer to specific coremap_entry */
-struct coremap_entry*
-get_coremapentry( paddr_t paddr){
+	paddr = get_ppage(as, vaddr);
+	if (paddr == 0){
+		return ENOMEM;
+	}
+	index = PADDR_TO_CMINDEX(paddr);
 
-	/* make sure paddr is page aligned */
-	paddr &= paddr;
-	
-	assert(paddr % PAGE_SIZE == 0);
+	lock_acquire(swap_lock);
 
-	struct coremap_entry* cmptr;
-	int coremap_index = paddr / PAGE_SIZE;
-	
-	cmptr = coremap[coremap_index];
+	if (!IS_SWAPPED(*pte) || GET_SWAPSLOT(*pte) != slot){
+		lock_release(swap_lock);
+		free_ppage(as, vaddr, paddr / PAGE_SIZE);
+		return 0;
+	}
 
-	return cmptr;
-}
+	result = loadpage(slot, paddr);
+	if (result){
+		lock_release(swap_lock);
+		free_ppage(as, vaddr, paddr / PAGE_SIZE);
+		return result;
+	}
+
+	*pte = SET_VALID(SET_PFN(GET_PROT(*pte), paddr / PAGE_SIZE));
+	if (swap_refcount(slot) > 1){
+		swap_free(slot);
+		coremap[index].pstate = PDIRTY;
+		*pte = SET_DIRTY(*pte);
+	}
+	else{
+		coremap[index].swapslot = slot;
+		coremap[index].pstate = PCLEAN;
+	}
 
+	lock_release(swap_lock);
+	return 0;
+}
 
-// TODO: change this when doing swapping
-/* Allocate/free some kernel-space virtual pages, only called by kmalloc */
-// Need to implement synchronization here
+/*
+ * Fault-around.
+ *
+ * A sweep over an array takes one fault per page. To cut that down,
+ * once a page is in, vm_fault also looks at the pages within a window
+ * on either side of it (in the same page table and region): resident
+ * ones go straight into the TLB, and ones that were never touched are
+ * brought in ahead of time, zero-filled or read from the executable.
+ * Pages pushed into the TLB this way get their ref bit set, since a
+ * sweep that got here is likely to touch them next. Swapped-out pages
+ * are left alone, and nothing is brought in ahead when memory is short.
+ *
+ * The window is set per kind of region (indexed by VR_*), so the effect
+ * can be measured for each; a window of 0 turns fault-around off for it.
+ */
+#define FA_MAXWINDOW 16   // most pages on each side
+#define FA_MINFREE 64     // free pages needed to bring pages in ahead
+
+static struct faregion {
+	const char *name;
+	int window;           // pages on each side of the fault
+	u_int32_t mapped;     // resident neighbours put into the TLB
+	u_int32_t ahead;      // neighbours brought in before their first touch
+} faregions[] = {          // in VR_* order
+	{ "elf",	4, 0, 0 },
+	{ "heap",	4, 0, 0 },
+	{ "stack",	4, 0, 0 },
+	{ "anon",	4, 0, 0 },
+	{ "file",	4, 0, 0 },
+	{ NULL, 0, 0, 0 }
+};
 
-vaddr_t
-alloc_kpages(int npages)
+int
+vm_setfaultaround(const char *region, int pages)
 {
-	int spl;
-	int count, index, offset;
-	paddr_t paddr;
+	int i, spl;
 
-	spl = splhigh();
+	if (pages < 0 || pages > FA_MAXWINDOW){
+		return EINVAL;
+	}
+	for (i = 0; faregions[i].name != NULL; i++){
+		if (!strcmp(region, faregions[i].name)){
+			spl = splhigh();
+			faregions[i].window = pages;
+			faregions[i].mapped = faregions[i].ahead = 0;
+			splx(spl);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
 
-	// need 1 or n contiguous pages free
+static
+void
+fa_printstats(void)
+{
 	int i;
-	for (i = 0 ; i < coremap_size ; i++){
-		if (coremap[i].pstate == PFREE){
-			count ++;
-
-			for ( offset = 1 ; offset < npages; offset ++){
-				// if another free page, increment count
-				if (coremap[i+offset].pstate == PFREE){
-					count++;
-				}
-
-				// Restart count again
-				else{
-					count = 0;
-					break;
-				}
-			}
-		}
-	
-		// number of pages required found
-		if (count == npages){
-			index = i;
-			break;
-		}
+
+	for (i = 0; faregions[i].name != NULL; i++){
+		kprintf("faultaround %s: window %d, %u mapped, %u ahead\n",
+			faregions[i].name, faregions[i].window,
+			faregions[i].mapped, faregions[i].ahead);
 	}
+}
 
-	// No free n pages found, return 0 for error
-	if (count < npages){
-		//lock_release(coremap_lock);
-		splx(spl);		
+/*
+ * Bring in the untouched neighbour at vaddr ahead of time, the way a
+ * fault of type faulttype on it would. Returns nonzero if it did.
+ */
+static
+int
+fa_ahead(struct addrspace *as, vaddr_t vaddr, int *pte,
+	 struct vm_region *vr, int faulttype)
+{
+	if (coremap_freepages() <= FA_MINFREE){
 		return 0;
 	}
 
-	// Only first page can contain chunk size
-	coremap[index].block_size = npages;
-
-	// Set the rest
-	for (i = 0 ; i< npages; i++){
-		coremap[index+i].pstate = PKERNEL;
-		coremap[index+i].vaddr = PADDR_TO_KVADDR((i+index)*PAGE_SIZE);
-		if (i != 0)		
-			coremap[index+i].block_size = 0;
+	if (*pte == 0 && vr->vr_type == VR_FILE){
+		*pte = SET_ELF(vr->vr_prot);
 	}
-	
-	paddr = coremap[index].paddr;
-	//lock_release(coremap_lock);
-	
-	splx(spl);
-	return PADDR_TO_KVADDR(paddr);
+	if (IS_ELF(*pte)){
+		return elf_in(as, vr, vaddr, pte) == 0;
+	}
+	if (*pte == 0 && vr->vr_type != VR_ELF){
+		*pte = vr->vr_prot;
+		if (faulttype == VM_FAULT_READ){
+			zero_map(pte);
+			return 1;
+		}
+		if (zero_fill(as, vaddr, pte)){
+			*pte = 0;
+			return 0;
+		}
+		return 1;
+	}
+	return 0;
 }
 
-
-
-/* Kernel free pages function, only called by kfree */
+/*
+ * Map the neighbours of the page at vaddr that just faulted in.
+ * Interrupts must be off. May sleep reading the executable.
+ */
+static
 void
-free_kpages(vaddr_t addr)
+fault_around(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr,
+	     int faulttype)
 {
-	int pageIndex, npages, i;
-	int spl = splhigh();
-
-	// Convert vaddr to paddr
-	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	struct faregion *r;
+	vaddr_t start, end, table, va;
+	paddr_t paddr;
+	int *pte;
 
-	// Check if page aligned and compute the physical page index
-	assert((paddr % PAGE_SIZE) == 0);
-	pageIndex = paddr/ PAGE_SIZE;
+	r = &faregions[vr->vr_type];
+	if (r->window == 0){
+		return;
+	}
 
-	// Only the first ppage of the block has block_size info
-	assert(coremap[pageIndex].block_size != 0);
+	// Clip the window to the region and the page table vaddr is in
+	start = vr->vr_start;
+	end = VR_END(vr);
+	table = vaddr & ~(PT_SPAN - 1);
+	if (start < table){
+		start = table;
+	}
+	if (end > table + PT_SPAN){
+		end = table + PT_SPAN;
+	}
+	if (vaddr - start > (vaddr_t)r->window * PAGE_SIZE){
+		start = vaddr - r->window * PAGE_SIZE;
+	}
+	if (end - vaddr > (vaddr_t)(r->window + 1) * PAGE_SIZE){
+		end = vaddr + (r->window + 1) * PAGE_SIZE;
+	}
 
-	//lock_acquire(coremap_lock);
+	for (va = start; va < end; va += PAGE_SIZE){
+		if (va == vaddr){
+			continue;
+		}
+		pte = find_pte(as, va, 0);
+		if (pte == NULL){
+			continue;
+		}
 
-	// Since all these pages are kernel pages, it is already to be contiguous
-	// TODO: maybe add the PID?
-	for (i = 0 ; i < npages; i++){
+		if (!IS_VALID(*pte)){
+			if (!fa_ahead(as, va, pte, vr, faulttype)){
+				continue;
+			}
+			r->ahead++;
+			// elf_in may have slept and lost it again
+			if (!IS_VALID(*pte)){
+				continue;
+			}
+		}
+		else if (TLB_Probe(va | asid_tlbhi(as), 0) >= 0){
+			continue;
+		}
+		else{
+			r->mapped++;
+		}
 
-		coremap[i+pageIndex].vaddr = 0x0;
-		coremap[i+pageIndex].block_size = 0;
-		coremap[i+pageIndex].pstate = PFREE;
+		paddr = GET_PFN(*pte) * PAGE_SIZE;
+		*pte = SET_REF(*pte);
+		tlb_load(as, va, paddr, IS_DIRTY(*pte) && !IS_COW(*pte));
 	}
-
-	//lock_release(coremap_lock);
-	splx(spl);
 }
 
-
-// TODO: dumb
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	u_int32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	struct vm_region *vr;
+	int *pte;
+	int spl, result, lazy;
+	paddr_t paddr;
 
-	spl = splhigh();
-	
 	// getting the virtual page number
 	faultaddress &= PAGE_FRAME;
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+	vm_faults++;
+	if (faulttype != VM_FAULT_READONLY){
+		tlb_misses++;
+	}
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
 	    default:
-		splx(spl);
 		return EINVAL;
 	}
 
@@ -353,102 +1807,113 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	assert(as->as_vbase1 != 0);
-	assert(as->as_pbase1 != 0);
-	assert(as->as_npages1 != 0);
-	assert(as->as_vbase2 != 0);
-	assert(as->as_pbase2 != 0);
-	assert(as->as_npages2 != 0);
-	assert(as->as_stackpbase != 0);
-	assert((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	assert((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	assert((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	assert((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	assert((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	// find out which region of virtual address space
-	// the fault address is and convert it to physical address
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
+	spl = splhigh();
+
+	vr = as_region(as, faultaddress);
+	if (vr == NULL){
 		splx(spl);
 		return EFAULT;
 	}
 
-	/* make sure it's page-aligned */
-	assert((paddr & PAGE_FRAME)==paddr);
-
-	// put requested page into TLB
-	// TODO: simple: make better
-	
-	// pick the TLB entry to evict
-	i = evict();	// for now does a roundrobin replace
-	assert (i >=0);
-	assert (i < NUM_TLB);
-
-	// enter the missing page entry
-	ehi = faultaddress;		// this is actually the virtual page number
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;	// DUMB: dirty bit always on?
-	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	// Only pages of the executable get their PTEs up front. Heap,
+	// stack and mmap pages get one on first touch; a first read of an
+	// anonymous page maps the zero page
+	lazy = (vr->vr_type != VR_ELF);
 
-// for debugging	
-#ifdef VM_DEBUG
-	kprintf ("Current Thread: %x",curthread);
-	kprintf ("Writing to TLB%2d: %8x %8x\n",i,ehi,elo);
+	pte = find_pte(as, faultaddress, lazy);
+	if (pte == NULL){
+		splx(spl);
+		return lazy ? ENOMEM : EFAULT;
+	}
+	if (*pte == 0){
+		if (!lazy){
+			splx(spl);
+			return EFAULT;
+		}
+		*pte = vr->vr_prot;
 
-#endif
+		// Pages of a mapped file are read in like the executable's
+		if (vr->vr_type == VR_FILE){
+			*pte = SET_ELF(*pte);
+		}
+	}
 
-	TLB_Write(ehi, elo, i);
-	
-// for debugging	
-#ifdef VM_DEBUG
-	TLB_Read(&ehi, &elo, i);
-	kprintf ("Read from TLB: %2d: %8x %8x\n",i,ehi,elo);
-	printtlb();
-#endif
-	splx(spl);
+	if (IS_ELF(*pte)){
+		result = elf_in(as, vr, faultaddress, pte);
+		if (result){
+			splx(spl);
+			return result;
+		}
+	}
+	else if (IS_SWAPPED(*pte)){
+		result = swap_in(as, faultaddress, pte);
+		if (result){
+			splx(spl);
+			return result;
+		}
+	}
+	else if (!IS_VALID(*pte) && faulttype == VM_FAULT_READ){
+		zero_map(pte);
+	}
+	else if (!IS_VALID(*pte)){
+		result = zero_fill(as, faultaddress, pte);
+		if (result){
+			splx(spl);
+			return result;
+		}
+	}
 
-	return 0;
-/* DUMB
-	// check for an invalid (i.e. empty) tlb slot
-	// if can't find one than just self-destruct 
-	for (i=0; i<NUM_TLB; i++) {
-		TLB_Read(&ehi, &elo, i);
-		// check if valid
-		if (elo & TLBLO_VALID) {
-			continue;
+	if (faulttype != VM_FAULT_READ){
+		if (!IS_WTABLE(*pte)){
+			splx(spl);
+			return EFAULT;
+		}
+		if (IS_ZEROPAGE(*pte)){
+			result = zero_fill(as, faultaddress, pte);
+			if (result){
+				splx(spl);
+				return result;
+			}
+		}
+		else if (IS_VALID(*pte) && IS_COW(*pte)){
+			result = cow_split(as, faultaddress, pte);
+			if (result){
+				splx(spl);
+				return result;
+			}
+		}
+		if (IS_VALID(*pte)){
+			*pte = SET_DIRTY(*pte);
 		}
+	}
 
-		// found an empty slot in TLB
-		// enter the missing page entry
-		ehi = faultaddress;	// this is actually the page number
-		// DUMB: dirty bit always on?
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		TLB_Write(ehi, elo, i);
+	// We slept and lost the page again; just let the access refault
+	if (!IS_VALID(*pte)){
 		splx(spl);
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
-*/	
+	paddr = GET_PFN(*pte) * PAGE_SIZE;
+	if (IS_DIRTY(*pte)){
+		coremap[PADDR_TO_CMINDEX(paddr)].pstate = PDIRTY;
+	}
 
-}
+	// Page replacement looks at this, see vm/replace.c
+	*pte = SET_REF(*pte);
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+	/*
+	 * Clean and copy-on-write pages go in read-only, so the first
+	 * write comes back as VM_FAULT_READONLY and we get to see it.
+	 */
+	tlb_load(as, faultaddress, paddr, IS_DIRTY(*pte) && !IS_COW(*pte));
+
+	// A write to a read-only entry is about this page alone
+	if (faulttype != VM_FAULT_READONLY){
+		fault_around(as, vr, faultaddress, faulttype);
+	}
 
+	splx(spl);
+	return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * Compressed swap cache.
+ *
+ * Sits between the coremap and the swap disk. A page going out to swap
+ * is compressed and kept in kernel memory under its swap slot, and
+ * only written to the disk when it doesn't compress well or the pool is
+ * full. Swapping it back in is then a decompress instead of a disk read.
+ *
+ * The pool is capped at a fraction of RAM (zswap_maxbytes). When a new
+ * page doesn't fit, the oldest pages in the pool are spilled: written
+ * out to their slot on disk and dropped from the pool. The allocator
+ * spills them the same way through the pool's shrinker when it needs
+ * the memory back. Slots are still
+ * allocated from the swap bitmap as before, so the disk always has room
+ * for everything the pool holds.
+ *
+ * The codec is a small LZ77 variant, byte oriented so that it is cheap
+ * on the r3000:
+ *
+ *   0x00-0x7f  n+1 literal bytes follow
+ *   0x80-0xff  match of (n & 0x7f) + 3 bytes, starting the 16-bit
+ *              offset (low byte first) that follows back in the output
+ *
+ * Matches are found through a hash of the next three bytes, so runs of
+ * zeros and repeated structures compress well.
+ *
+ * All of this is called from swap.c. Storing, loading and spilling
+ * happen with swap_lock held; the pool itself is protected by turning
+ * interrupts off, since swap_free can drop a slot without the lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <machine/spl.h>
+
+#define LZ_HASHBITS 10
+#define LZ_HASHSIZE (1 << LZ_HASHBITS)
+#define LZ_MINMATCH 3
+#define LZ_MAXMATCH (0x7f + LZ_MINMATCH)
+#define LZ_MAXLITS 0x80
+
+/* A compressed page; the data follows the header */
+struct zentry {
+	int ze_slot;
+	int ze_len;
+	u_int32_t ze_size;        // bytes kmalloc really gave us
+	struct zentry *ze_prev;   // next older entry
+	struct zentry *ze_next;   // next newer entry
+};
+
+/*
+ * Pages that don't shrink below this go straight to disk. An entry has
+ * to fit in kmalloc's largest subpage block, which is half a page (and
+ * exactly half a page already gets a whole one); anything bigger costs
+ * as much memory as the page it was meant to save.
+ */
+#define ZSWAP_MAXSIZE (PAGE_SIZE / 2 - sizeof(struct zentry) - 1)
+
+static struct zentry **zswap_map;   // entry for each swap slot, or NULL
+static int zswap_nslots;
+static struct zentry *zswap_oldest;
+static struct zentry *zswap_newest;
+static int zswap_on = 1;
+static u_int32_t zswap_maxbytes;
+
+/* Compressor state and scratch space, only used with swap_lock held */
+static u_int16_t lz_table[LZ_HASHSIZE];   // last position + 1, 0 if none
+static u_int8_t *zswap_buf;               // ZSWAP_MAXSIZE bytes
+static u_int8_t *zswap_spillbuf;          // one page
+
+static struct shrinker zswap_shrinker;
+static int zswap_shrink(int npages);
+
+/* Counters */
+static u_int32_t zswap_pages;     // pages in the pool
+static u_int32_t zswap_bytes;     // memory they take, as kmalloc counts it
+static u_int32_t zswap_stored;    // pages compressed into the pool
+static u_int32_t zswap_rejected;  // pages that didn't compress well enough
+static u_int32_t zswap_spilled;   // pages pushed out to disk to make room
+static u_int32_t zswap_hits;      // swap-ins served from the pool
+static u_int32_t zswap_misses;    // swap-ins that had to read the disk
+static u_int32_t zswap_hitusecs;  // time spent on them, for the averages
+static u_int32_t zswap_missusecs;
+
+static
+u_int32_t
+lz_hash(const u_int8_t *p)
+{
+	u_int32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+/* Emit the literals src[0..n), -1 if they don't fit in dst[op..max) */
+static
+int
+lz_literals(u_int8_t *dst, int op, int max, const u_int8_t *src, int n)
+{
+	int chunk;
+
+	while (n > 0){
+		chunk = n > LZ_MAXLITS ? LZ_MAXLITS : n;
+		if (op + 1 + chunk > max){
+			return -1;
+		}
+		dst[op++] = chunk - 1;
+		memmove(dst + op, src, chunk);
+		op += chunk;
+		src += chunk;
+		n -= chunk;
+	}
+	return op;
+}
+
+/*
+ * Compress one page from src into dst. Returns the compressed length,
+ * or -1 if it would be longer than max.
+ */
+static
+int
+lz_compress(const u_int8_t *src, u_int8_t *dst, int max)
+{
+	int ip, lit, op, cand, len;
+	u_int32_t h;
+
+	bzero(lz_table, sizeof(lz_table));
+
+	ip = lit = op = 0;
+	while (ip + LZ_MINMATCH <= PAGE_SIZE){
+		h = lz_hash(src + ip);
+		cand = lz_table[h] - 1;
+		lz_table[h] = ip + 1;
+
+		if (cand < 0 || src[cand] != src[ip] ||
+		    src[cand + 1] != src[ip + 1] || src[cand + 2] != src[ip + 2]){
+			ip++;
+			continue;
+		}
+
+		op = lz_literals(dst, op, max, src + lit, ip - lit);
+		if (op < 0 || op + 3 > max){
+			return -1;
+		}
+
+		len = LZ_MINMATCH;
+		while (ip + len < PAGE_SIZE && len < LZ_MAXMATCH &&
+		       src[cand + len] == src[ip + len]){
+			len++;
+		}
+		dst[op++] = 0x80 | (len - LZ_MINMATCH);
+		dst[op++] = (ip - cand) & 0xff;
+		dst[op++] = (ip - cand) >> 8;
+
+		ip += len;
+		lit = ip;
+	}
+
+	return lz_literals(dst, op, max, src + lit, PAGE_SIZE - lit);
+}
+
+/* Inflate len bytes at src into one page at dst. EIO if corrupt. */
+static
+int
+lz_decompress(const u_int8_t *src, int len, u_int8_t *dst)
+{
+	int ip, op, n, off;
+
+	ip = op = 0;
+	while (ip < len){
+		if (src[ip] & 0x80){
+			if (ip + 3 > len){
+				return EIO;
+			}
+			n = (src[ip] & 0x7f) + LZ_MINMATCH;
+			off = src[ip + 1] | (src[ip + 2] << 8);
+			ip += 3;
+			if (off == 0 || off > op || op + n > PAGE_SIZE){
+				return EIO;
+			}
+			// May overlap itself, so byte by byte
+			while (n-- > 0){
+				dst[op] = dst[op - off];
+				op++;
+			}
+		}
+		else{
+			n = src[ip++] + 1;
+			if (ip + n > len || op + n > PAGE_SIZE){
+				return EIO;
+			}
+			memmove(dst + op, src + ip, n);
+			ip += n;
+			op += n;
+		}
+	}
+	return op == PAGE_SIZE ? 0 : EIO;
+}
+
+/*
+ * Set up the pool for a swap disk of nslots slots. Called from
+ * swap_bootstrap once the disk is open.
+ */
+void
+zswap_bootstrap(int nslots)
+{
+	zswap_map = kmalloc(nslots * sizeof(struct zentry *));
+	zswap_buf = kmalloc(ZSWAP_MAXSIZE);
+	zswap_spillbuf = kmalloc(PAGE_SIZE);
+	if (zswap_map == NULL || zswap_buf == NULL || zswap_spillbuf == NULL){
+		panic("zswap: Out of memory\n");
+	}
+	bzero(zswap_map, nslots * sizeof(struct zentry *));
+	zswap_nslots = nslots;
+
+	// A quarter of memory, compressed
+	zswap_maxbytes = coremap_size * PAGE_SIZE / 4;
+
+	// Costs a disk write per page, so after the cheaper caches
+	shrinker_register(&zswap_shrinker, "zswap", zswap_shrink);
+}
+
+/* Unlink e from the pool and free it. Interrupts must be off. */
+static
+void
+zswap_drop(struct zentry *e)
+{
+	if (e->ze_prev != NULL){
+		e->ze_prev->ze_next = e->ze_next;
+	}
+	else{
+		zswap_oldest = e->ze_next;
+	}
+	if (e->ze_next != NULL){
+		e->ze_next->ze_prev = e->ze_prev;
+	}
+	else{
+		zswap_newest = e->ze_prev;
+	}
+
+	zswap_map[e->ze_slot] = NULL;
+	zswap_pages--;
+	zswap_bytes -= e->ze_size;
+	kfree(e);
+}
+
+/*
+ * Write the oldest page in the pool out to its slot and drop it.
+ * Returns 0, or an error if the pool is empty or the write failed.
+ */
+static
+int
+zswap_spill(void)
+{
+	struct zentry *e;
+	int slot, result, spl;
+
+	spl = splhigh();
+	e = zswap_oldest;
+	if (e == NULL){
+		splx(spl);
+		return ENOMEM;
+	}
+	slot = e->ze_slot;
+	result = lz_decompress((u_int8_t *)(e + 1), e->ze_len, zswap_spillbuf);
+	if (result){
+		panic("zswap: slot %d is corrupt\n", slot);
+	}
+	zswap_drop(e);
+	splx(spl);
+
+	// swap_lock keeps anyone from reading the slot until it is written
+	result = swap_write(zswap_spillbuf, slot, 1);
+	if (result){
+		return result;
+	}
+	zswap_spilled++;
+	return 0;
+}
+
+/*
+ * Shrinker for the pool: spill the oldest pages to disk until npages
+ * frames have come back to the coremap. Entries are smaller than a
+ * page, so most spills free no frame at all; counting pool bytes would
+ * claim progress that the allocator cannot use. The writes need
+ * swap_lock, so nothing happens in an interrupt handler or inside a
+ * page-out.
+ */
+static
+int
+zswap_shrink(int npages)
+{
+	int before, freed;
+
+	if (in_interrupt || zswap_oldest == NULL ||
+	    lock_do_i_hold(swap_lock)){
+		return 0;
+	}
+
+	lock_acquire(swap_lock);
+	before = coremap_freepages();
+	freed = 0;
+	while (freed < npages){
+		if (zswap_spill()){
+			break;
+		}
+		freed = coremap_freepages() - before;
+	}
+	lock_release(swap_lock);
+
+	return freed > 0 ? freed : 0;
+}
+
+/*
+ * Keep a compressed copy of the page for slot instead of writing it to
+ * disk. Returns 0 if it is in the pool, nonzero if the caller has to
+ * write it out itself. Caller must hold swap_lock.
+ */
+int
+zswap_store(int slot, const void *page)
+{
+	struct zentry *e;
+	u_int32_t size;
+	int len, spl;
+
+	assert(lock_do_i_hold(swap_lock));
+	assert(slot >= 0 && slot < zswap_nslots);
+
+	// Whatever we had for the slot is out of date now
+	zswap_invalidate(slot);
+
+	if (!zswap_on){
+		return ENOSYS;
+	}
+
+	len = lz_compress(page, zswap_buf, ZSWAP_MAXSIZE);
+	if (len < 0){
+		zswap_rejected++;
+		return E2BIG;
+	}
+
+	size = kmalloc_size(sizeof(struct zentry) + len);
+	while (zswap_bytes + size > zswap_maxbytes){
+		if (zswap_spill()){
+			return ENOSPC;
+		}
+	}
+
+	// Fails rather than recursing into pageout or the OOM killer,
+	// we hold swap_lock
+	e = kmalloc(sizeof(struct zentry) + len);
+	if (e == NULL){
+		return ENOMEM;
+	}
+	memmove(e + 1, zswap_buf, len);
+	e->ze_slot = slot;
+	e->ze_len = len;
+	e->ze_size = size;
+
+	spl = splhigh();
+	e->ze_next = NULL;
+	e->ze_prev = zswap_newest;
+	if (zswap_newest != NULL){
+		zswap_newest->ze_next = e;
+	}
+	else{
+		zswap_oldest = e;
+	}
+	zswap_newest = e;
+	zswap_map[slot] = e;
+	zswap_pages++;
+	zswap_bytes += size;
+	zswap_stored++;
+	splx(spl);
+
+	return 0;
+}
+
+/*
+ * Fill page from the pool if it holds slot. Returns 0 on a hit, ENOENT
+ * if the page has to come from disk. The copy stays in the pool, so a
+ * page that is swapped in and stays clean can go again for free.
+ * Caller must hold swap_lock.
+ */
+int
+zswap_load(int slot, void *page)
+{
+	struct zentry *e;
+	int result;
+
+	assert(lock_do_i_hold(swap_lock));
+	assert(slot >= 0 && slot < zswap_nslots);
+
+	e = zswap_map[slot];
+	if (e == NULL){
+		return ENOENT;
+	}
+
+	result = lz_decompress((u_int8_t *)(e + 1), e->ze_len, page);
+	if (result){
+		panic("zswap: slot %d is corrupt\n", slot);
+	}
+	return 0;
+}
+
+/* The slot was freed or rewritten, forget its compressed copy */
+void
+zswap_invalidate(int slot)
+{
+	int spl;
+
+	assert(slot >= 0 && slot < zswap_nslots);
+
+	spl = splhigh();
+	if (zswap_map[slot] != NULL){
+		zswap_drop(zswap_map[slot]);
+	}
+	splx(spl);
+}
+
+/* Account a swap-in that took usecs, hit says where it came from */
+void
+zswap_account(int hit, u_int32_t usecs)
+{
+	if (hit){
+		zswap_hits++;
+		zswap_hitusecs += usecs;
+	}
+	else{
+		zswap_misses++;
+		zswap_missusecs += usecs;
+	}
+}
+
+/*
+ * Turn compressing pages on or off. Pages already in the pool stay
+ * there until they are swapped in, freed or spilled, so swap-ins can be
+ * timed against the disk on the same workload. Resets the counters.
+ */
+void
+zswap_setenabled(int on)
+{
+	int spl;
+
+	spl = splhigh();
+	zswap_on = on;
+	zswap_stored = zswap_rejected = zswap_spilled = 0;
+	zswap_hits = zswap_misses = 0;
+	zswap_hitusecs = zswap_missusecs = 0;
+	splx(spl);
+}
+
+void
+zswap_printstats(void)
+{
+	u_int32_t raw;
+
+	if (zswap_map == NULL){
+		return;
+	}
+
+	raw = zswap_pages * PAGE_SIZE;
+	kprintf("zswap: %s, %u pages in %u/%u bytes", zswap_on ? "on" : "off",
+		zswap_pages, zswap_bytes, zswap_maxbytes);
+	if (zswap_bytes > 0){
+		kprintf(" (ratio %u.%02u)", raw / zswap_bytes,
+			(raw % zswap_bytes) * 100 / zswap_bytes);
+	}
+	kprintf(", %u stored, %u rejected, %u spilled\n", zswap_stored,
+		zswap_rejected, zswap_spilled);
+
+	kprintf("zswap: %u hits, %u misses", zswap_hits, zswap_misses);
+	if (zswap_hits + zswap_misses > 0){
+		kprintf(" (%u%% hit rate)",
+			zswap_hits * 100 / (zswap_hits + zswap_misses));
+	}
+	if (zswap_hits > 0){
+		kprintf(", %u us per hit", zswap_hitusecs / zswap_hits);
+	}
+	if (zswap_misses > 0){
+		kprintf(", %u us per disk read",
+			zswap_missusecs / zswap_misses);
+	}
+	kprintf("\n");
+}
@@ -108,6 +108,12 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * When a free block of at least MTRIMSIZE bytes ends up at the top of
+ * the heap, free() gives it back to the system with a negative sbrk.
+ */
+#define MTRIMSIZE	(64*1024)
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -450,6 +456,31 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * Give the free block mh at the top of the heap back with sbrk, if it
+ * is big enough to be worth it.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t size = M_NEXTOFF(mh);
+
+	if (size < MTRIMSIZE) {
+		return;
+	}
+
+	if (sbrk(-(int)size) == (void *)-1) {
+		/* just keep it then */
+		return;
+	}
+	__heaptop = (uintptr_t)mh;
+
+#ifdef MALLOCDEBUG
+	warnx("free: trimmed %lu bytes off the heap", (unsigned long) size);
+#endif
+}
+
 /*
  * The actual free() implementation.
  */
@@ -505,6 +536,14 @@ free(void *x)
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
 		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			mh = mhprev;
+		}
+	}
+
+	/* Give the top of the heap back if it is free now */
+	if (M_NEXT(mh) == (struct mheader *)__heaptop) {
+		__malloc_trim(mh);
 	}
 
 #ifdef MALLOCDEBUG